@@ -33,25 +33,26 @@ int main(int argc, char *argv[])
 	for (i = 0; i < 16; ++i)
 		sprintf(filename[i], "file%d", i);
 
-	if (argc != 2) {
-		printf ("usage: app <diskname>\n");
+	if (argc != 2 && (argc != 3 || strcmp(argv[2], "mmap"))) {
+		printf ("usage: app <diskname> [mmap]\n");
 		exit (1);
 	}
 
 	strcpy (diskname, argv[1]);
+	int opts = argc == 3 ? MYFS_MMAP : 0; // compare block cache and mapped disk
 
 	// test mounting, creating, writing, reading for different files and sizes
 	int siz; // size of writes and reads
 	for (i = 0, siz = 100; i < 5; ++i, siz *= 10) {
 		diff = 0;
-		MEASURE(!myfs_mount(diskname));
+		MEASURE(!myfs_mountopt(diskname, opts));
 		fprintf(stderr, "mount\t%d\t%ld\n", 16 * (i ? siz / 10 : 0), diff);
 
 		// create or open each file
 		for (j = 0; j < 16; ++j) {
 			diff = 0;
 			MEASURE((fd[j] = myfs_create(filename[j])) != -1);
-			fprintf(stderr, "%s\t%d\t%d\t%ld\n", i ? "open" : "create", j, myfs_filesize(fd[j]), diff);
+			fprintf(stderr, "%s\t%d\t%ld\t%ld\n", i ? "open" : "create", j, (long) myfs_filesize(fd[j]), diff);
 		}
 
 		// write siz bytes to each file
@@ -62,7 +63,7 @@ int main(int argc, char *argv[])
 				MEASURE(myfs_write(fd[j], buf, MAXREADWRITE) == MAXREADWRITE);
 			}
 			MEASURE(myfs_write(fd[j], buf, siz % MAXREADWRITE) == siz % MAXREADWRITE);
-			fprintf(stderr, "write\t%d\t%d\t%ld\n", j, myfs_filesize(fd[j]), diff);
+			fprintf(stderr, "write\t%d\t%ld\t%ld\n", j, (long) myfs_filesize(fd[j]), diff);
 		}
 
 		// close each file
@@ -77,7 +78,7 @@ int main(int argc, char *argv[])
 		for (j = 0; j < 16; ++j) {
 			diff = 0;
 			MEASURE((fd[j] = myfs_open(filename[j])) != -1);
-			fprintf(stderr, "open\t%d\t%d\t%ld\n", j, myfs_filesize(fd[j]), diff);
+			fprintf(stderr, "open\t%d\t%ld\t%ld\n", j, (long) myfs_filesize(fd[j]), diff);
 		}
 
 		// read siz bytes from each file
@@ -87,7 +88,7 @@ int main(int argc, char *argv[])
 				MEASURE(myfs_read(fd[j], buf, MAXREADWRITE) == MAXREADWRITE);
 			}
 			MEASURE(myfs_read(fd[j], buf, siz % MAXREADWRITE) == siz % MAXREADWRITE);
-			fprintf(stderr, "read\t%d\t%d\t%ld\n", j, myfs_filesize(fd[j]), diff);
+			fprintf(stderr, "read\t%d\t%ld\t%ld\n", j, (long) myfs_filesize(fd[j]), diff);
 			// myfs_truncate(fd[j], siz);
 			// fprintf(stderr, "truncate\t%d\t%d\n", j, myfs_filesize(fd[j]));
 		}
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "myfs.h"
+
+// benchmark driver: every test formats the disk afresh, times each call with the
+// wall clock and prints one JSON object per test, so that runs may be diffed
+
+#define MB (1 << 20)
+#define FILLCHUNK (64 << 10) // bytes written at a time when filling disk
+
+struct series {
+	char *test;
+	int size, files, fill; // request size, files in use, percentage of disk filled beforehand
+	int64_t *lat; // latency of each call in ns
+	int n, cap;
+	int64_t bytes, begin, end;
+};
+
+char *vdisk;
+int64_t disksize = 128 * MB;
+int blocksize = BLOCKSIZE, layout, mode, scale = 1, frames = CACHEFRAMES, results;
+char *buf;
+uint64_t seed = 88172645463325252ULL;
+
+int sizes[] = { 512, 4096, 65536, 1 << 20 };
+#define NSIZES (int) (sizeof(sizes) / sizeof(sizes[0]))
+
+void fail(char *what)
+{
+	fprintf(stderr, "bench: %s failed\n", what);
+	exit(1);
+}
+
+int64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift, same sequence on every run
+uint64_t rnd()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+void begin(struct series *s, char *test, int size, int files, int fill)
+{
+	memset(s, 0, sizeof(struct series));
+	s->test = test;
+	s->size = size;
+	s->files = files;
+	s->fill = fill;
+	s->begin = now();
+}
+
+void sample(struct series *s, int64_t ns, int64_t bytes)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 1024;
+		if (!(s->lat = realloc(s->lat, s->cap * sizeof(int64_t))))
+			fail("realloc");
+	}
+	s->lat[s->n++] = ns;
+	s->bytes += bytes;
+}
+
+// time one call, which must make cond true
+#define TIMED(s, bytes, cond) do {			\
+	int64_t t = now();				\
+	if (!(cond))					\
+		fail(#cond);				\
+	sample(s, now() - t, bytes);			\
+} while (0)
+
+int cmp64(const void *a, const void *b)
+{
+	int64_t x = *(int64_t *) a, y = *(int64_t *) b;
+	return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted latencies, in microseconds
+double pct(struct series *s, double p)
+{
+	int i = (int) (p / 100 * s->n + 0.999999) - 1;
+	return s->lat[i < 0 ? 0 : i] / 1e3;
+}
+
+// phase ends with the last call timed, or after flushing what it wrote
+void end(struct series *s)
+{
+	s->end = now();
+	if (!s->n)
+		return;
+
+	double secs = (s->end - s->begin) / 1e9, sum = 0;
+	qsort(s->lat, s->n, sizeof(int64_t), cmp64);
+	for (int i = 0; i < s->n; ++i)
+		sum += s->lat[i];
+
+	printf("%s\n    {\"test\": \"%s\", \"size\": %d, \"files\": %d, \"fill\": %d, \"ops\": %d, \"bytes\": %ld, "
+		"\"seconds\": %.6f, \"mbps\": %.2f, \"ops_per_sec\": %.1f, \"lat_us\": {\"mean\": %.2f, "
+		"\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}",
+		results++ ? "," : "", s->test, s->size, s->files, s->fill, s->n, (long) s->bytes,
+		secs, s->bytes / secs / MB, s->n / secs, sum / s->n / 1e3,
+		pct(s, 50), pct(s, 90), pct(s, 99), pct(s, 99.9), pct(s, 100));
+	fflush(stdout);
+	free(s->lat);
+}
+
+// empty disk file so that its blocks are released, then format it
+void format()
+{
+	int fd = open(vdisk, O_RDWR | O_CREAT, 0666);
+	if (fd == -1 || ftruncate(fd, 0))
+		fail("creating disk");
+	close(fd);
+	if (myfs_makefsgeom(vdisk, disksize, blocksize, MAXFILECOUNT, layout))
+		fail("formatting disk");
+}
+
+void mount()
+{
+	if (myfs_cachesize(frames) || myfs_mountopt(vdisk, mode))
+		fail("mounting disk");
+}
+
+// unmount and mount again, so that reads start with an empty cache
+void remount()
+{
+	if (myfs_umount())
+		fail("unmounting disk");
+	mount();
+}
+
+// write size bytes to fd in requests of chunk bytes
+void writeall(int fd, int64_t size, int chunk)
+{
+	for (int64_t off = 0; off < size; off += chunk) {
+		int n = size - off < chunk ? size - off : chunk;
+		if (myfs_write(fd, buf, n) != n)
+			fail("filling file");
+	}
+}
+
+// write files taking up fill percent of the disk, in chunks interleaved with a scratch file
+// that is deleted afterwards, so that free space is scattered across the disk
+void fill_disk(int percent)
+{
+	int fds[4], scratch;
+	char name[MAXFILENAMESIZE];
+	int64_t target = disksize / 100 * percent, budget = disksize / 100 * 95, kept = 0, holes = 0;
+
+	if (!percent)
+		return;
+	for (int i = 0; i < 4; ++i) {
+		sprintf(name, "fill%d", i);
+		if ((fds[i] = myfs_create(name)) < 0)
+			fail("creating fill file");
+	}
+	if ((scratch = myfs_create("scratch")) < 0)
+		fail("creating scratch file");
+
+	// a hole after a chunk whenever the holes left so far would still fit in the budget
+	for (int i = 0; kept < target; ++i) {
+		writeall(fds[i % 4], FILLCHUNK, FILLCHUNK);
+		kept += FILLCHUNK;
+		if ((holes + FILLCHUNK) * target <= (budget - target) * kept) {
+			writeall(scratch, FILLCHUNK, FILLCHUNK);
+			holes += FILLCHUNK;
+		}
+	}
+
+	for (int i = 0; i < 4; ++i)
+		if (myfs_close(fds[i]))
+			fail("closing fill file");
+	if (myfs_close(scratch) || myfs_delete("scratch") || myfs_sync())
+		fail("deleting scratch file");
+}
+
+// sequential write of a new file, then sequential read of it with an empty cache
+void seq(int64_t size, int chunk, int percent)
+{
+	struct series s;
+	int fd;
+
+	format();
+	mount();
+	fill_disk(percent);
+	if ((fd = myfs_create("seq")) < 0)
+		fail("creating file");
+
+	begin(&s, "seqwrite", chunk, 1, percent);
+	for (int64_t off = 0; off < size; off += chunk)
+		TIMED(&s, chunk, myfs_write(fd, buf, chunk) == chunk);
+	if (myfs_fsync(fd))
+		fail("myfs_fsync");
+	end(&s);
+
+	if (myfs_close(fd))
+		fail("closing file");
+	remount();
+	if ((fd = myfs_open("seq")) < 0)
+		fail("opening file");
+
+	begin(&s, "seqread", chunk, 1, percent);
+	for (int64_t off = 0; off < size; off += chunk)
+		TIMED(&s, chunk, myfs_read(fd, buf, chunk) == chunk);
+	end(&s);
+
+	if (myfs_close(fd) || myfs_umount())
+		fail("unmounting disk");
+}
+
+// random aligned reads and writes within an existing file
+void rnd_rw(int64_t size, int chunk, int percent)
+{
+	struct series s;
+	int fd, ops = size / chunk;
+
+	ops = ops < 256 ? 256 : ops > 4096 ? 4096 : ops;
+	format();
+	mount();
+	fill_disk(percent);
+	if ((fd = myfs_create("rnd")) < 0)
+		fail("creating file");
+	writeall(fd, size, MB);
+	if (myfs_close(fd))
+		fail("closing file");
+	remount();
+	if ((fd = myfs_open("rnd")) < 0)
+		fail("opening file");
+
+	begin(&s, "randwrite", chunk, 1, percent);
+	for (int i = 0; i < ops; ++i) {
+		int64_t off = rnd() % (size / chunk) * chunk;
+		TIMED(&s, chunk, myfs_seek(fd, off) == off && myfs_write(fd, buf, chunk) == chunk);
+	}
+	if (myfs_fsync(fd))
+		fail("myfs_fsync");
+	end(&s);
+
+	if (myfs_close(fd))
+		fail("closing file");
+	remount();
+	if ((fd = myfs_open("rnd")) < 0)
+		fail("opening file");
+
+	begin(&s, "randread", chunk, 1, percent);
+	for (int i = 0; i < ops; ++i) {
+		int64_t off = rnd() % (size / chunk) * chunk;
+		TIMED(&s, chunk, myfs_seek(fd, off) == off && myfs_read(fd, buf, chunk) == chunk);
+	}
+	end(&s);
+
+	if (myfs_close(fd) || myfs_umount())
+		fail("unmounting disk");
+}
+
+// size bytes spread over files files: create and write each in turn, then open and read each
+void many(int64_t size, int files)
+{
+	struct series s, data;
+	char name[MAXFILENAMESIZE];
+	int64_t each = size / files / 4096 * 4096;
+	int fd;
+
+	format();
+	mount();
+
+	begin(&s, "create", 0, files, 0);
+	begin(&data, "manywrite", 65536, files, 0);
+	for (int i = 0; i < files; ++i) {
+		sprintf(name, "f%d", i);
+		TIMED(&s, 0, (fd = myfs_create(name)) >= 0);
+		for (int64_t off = 0; off < each; off += 65536) {
+			int n = each - off < 65536 ? each - off : 65536;
+			TIMED(&data, n, myfs_write(fd, buf, n) == n);
+		}
+		if (myfs_close(fd))
+			fail("closing file");
+	}
+	end(&s);
+	if (myfs_sync())
+		fail("myfs_sync");
+	end(&data);
+
+	remount();
+	begin(&s, "open", 0, files, 0);
+	begin(&data, "manyread", 65536, files, 0);
+	for (int i = 0; i < files; ++i) {
+		sprintf(name, "f%d", i);
+		TIMED(&s, 0, (fd = myfs_open(name)) >= 0);
+		for (int64_t off = 0; off < each; off += 65536) {
+			int n = each - off < 65536 ? each - off : 65536;
+			TIMED(&data, n, myfs_read(fd, buf, n) == n);
+		}
+		if (myfs_close(fd))
+			fail("closing file");
+	}
+	end(&s);
+	end(&data);
+
+	if (myfs_umount())
+		fail("unmounting disk");
+}
+
+// create, write, close and delete small files next to files resident files
+void churn(int cycles, int resident)
+{
+	struct series c, w, cl, d;
+	char name[MAXFILENAMESIZE];
+	int fd;
+
+	format();
+	mount();
+	for (int i = 0; i < resident; ++i) {
+		sprintf(name, "r%d", i);
+		if ((fd = myfs_create(name)) < 0)
+			fail("creating file");
+		writeall(fd, 16384, 16384);
+		if (myfs_close(fd))
+			fail("closing file");
+	}
+
+	begin(&c, "churncreate", 0, resident + 1, 0);
+	begin(&w, "churnwrite", 16384, resident + 1, 0);
+	begin(&cl, "churnclose", 0, resident + 1, 0);
+	begin(&d, "churndelete", 0, resident + 1, 0);
+	for (int i = 0; i < cycles; ++i) {
+		sprintf(name, "c%d", i);
+		TIMED(&c, 0, (fd = myfs_create(name)) >= 0);
+		TIMED(&w, 16384, myfs_write(fd, buf, 16384) == 16384);
+		TIMED(&cl, 0, myfs_close(fd) == 0);
+		TIMED(&d, 0, myfs_delete(name) == 0);
+	}
+	end(&c);
+	end(&w);
+	end(&cl);
+	end(&d);
+
+	if (myfs_umount())
+		fail("unmounting disk");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:b:c:o:xq")) != -1) {
+		switch (c) {
+		case 's': disksize = atoll(optarg) * MB; break;
+		case 'b': blocksize = atoi(optarg); break;
+		case 'c': frames = atoi(optarg); break;
+		case 'x': layout = MYFS_EXTENTS; break;
+		case 'q': scale = 4; break;
+		case 'o':
+			mode = !strcmp(optarg, "mmap") ? MYFS_MMAP : !strcmp(optarg, "aio") ? MYFS_AIO
+				: !strcmp(optarg, "shared") ? MYFS_SHARED : !strcmp(optarg, "lazy") ? MYFS_LAZYFREE : -1;
+			if (mode != -1)
+				break;
+			// fall through
+		default: argc = 0;
+		}
+	}
+	if (argc - optind != 1 || disksize < 64 * MB) {
+		printf("usage: bench [-s sizeMB (64 or more)] [-b blocksize] [-c cacheframes] [-o mmap|aio|shared|lazy] "
+			"[-x] [-q] <vdiskname> > results.json\n");
+		exit(1);
+	}
+	vdisk = argv[optind];
+	if (!(buf = malloc(MB)))
+		fail("malloc");
+	memset(buf, 'x', MB);
+
+	printf("{\n  \"config\": {\"disksize\": %ld, \"blocksize\": %d, \"cacheframes\": %d, \"layout\": \"%s\", "
+		"\"mode\": \"%s\", \"scale\": %d},\n  \"results\": [",
+		(long) disksize, blocksize, frames, layout ? "extents" : "fat",
+		mode == MYFS_MMAP ? "mmap" : mode == MYFS_AIO ? "aio" : mode == MYFS_SHARED ? "shared" : mode == MYFS_LAZYFREE ? "lazy" : "cache", scale);
+
+	// request sizes on an empty disk
+	for (int i = 0; i < NSIZES; ++i) {
+		fprintf(stderr, "sequential %d\n", sizes[i]);
+		seq(32 * MB / scale, sizes[i], 0);
+	}
+	for (int i = 0; i < NSIZES; ++i) {
+		fprintf(stderr, "random %d\n", sizes[i]);
+		rnd_rw(16 * MB / scale, sizes[i], 0);
+	}
+
+	// fill levels, test file fits in what is left of the disk
+	int fills[] = { 50, 90 };
+	for (int i = 0; i < 2; ++i) {
+		fprintf(stderr, "fill %d%%\n", fills[i]);
+		seq(4 * MB, 65536, fills[i]);
+		rnd_rw(4 * MB, 4096, fills[i]);
+	}
+
+	// file counts, and churn next to a few or many files
+	int counts[] = { 1, 16, MAXFILECOUNT };
+	for (int i = 0; i < 3; ++i) {
+		fprintf(stderr, "files %d\n", counts[i]);
+		many(32 * MB / scale, counts[i]);
+	}
+	fprintf(stderr, "churn\n");
+	churn(2000 / scale, 0);
+	churn(2000 / scale, MAXFILECOUNT - 1);
+
+	printf("\n  ]\n}\n");
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86
+#endif
+
+int bitmap_init(struct bitmap *bm, int nbits)
+{
+	uint64_t *words = calloc((nbits + 63) / 64, sizeof(uint64_t));
+	if (words == NULL)
+		return -1;
+
+	bitmap_attach(bm, nbits, words);
+	return 0;
+}
+
+void bitmap_attach(struct bitmap *bm, int nbits, uint64_t *words)
+{
+	bm->nbits = nbits;
+	bm->nwords = (nbits + 63) / 64;
+	bm->words = words;
+	bm->nfree = nbits;
+	bm->probes = 0;
+
+	// bits past nbits are never free
+	if (nbits % 64)
+		bm->words[bm->nwords - 1] = ~0ULL << (nbits % 64);
+}
+
+void bitmap_free(struct bitmap *bm)
+{
+	free(bm->words);
+	bm->words = NULL;
+}
+
+int bitmap_test(struct bitmap *bm, int i)
+{
+	return (bm->words[i / 64] >> (i % 64)) & 1;
+}
+
+void bitmap_set(struct bitmap *bm, int i)
+{
+	if (!bitmap_test(bm, i)) {
+		bm->words[i / 64] |= 1ULL << (i % 64);
+		bm->nfree--;
+	}
+}
+
+void bitmap_clear(struct bitmap *bm, int i)
+{
+	if (bitmap_test(bm, i)) {
+		bm->words[i / 64] &= ~(1ULL << (i % 64));
+		bm->nfree++;
+	}
+}
+
+// Scanning for words that are not full, i.e. contain a 0 bit
+
+// returns first word in [w, end) that is not all 1s, end if none
+static int scan_portable(const uint64_t *words, int w, int end)
+{
+	while (w < end && words[w] == ~0ULL)
+		++w;
+	return w;
+}
+
+#ifdef HAVE_X86
+// compares 2 words at a time
+static int scan_sse2(const uint64_t *words, int w, int end)
+{
+	const __m128i ones = _mm_set1_epi32(-1);
+
+	for (; w + 2 <= end; w += 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (words + w));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, ones)) != 0xffff)
+			break;
+	}
+	return scan_portable(words, w, end);
+}
+
+// compares 8 words at a time
+__attribute__((target("avx2")))
+static int scan_avx2(const uint64_t *words, int w, int end)
+{
+	const __m256i ones = _mm256_set1_epi32(-1);
+
+	for (; w + 8 <= end; w += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (words + w));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (words + w + 4));
+		__m256i full = _mm256_and_si256(_mm256_cmpeq_epi32(a, ones), _mm256_cmpeq_epi32(b, ones));
+		if (_mm256_movemask_epi8(full) != -1)
+			break;
+	}
+	return scan_sse2(words, w, end);
+}
+#endif
+
+static int scan(const uint64_t *words, int w, int end)
+{
+#ifdef HAVE_X86
+	static int avx2 = -1;
+	if (avx2 == -1)
+		avx2 = __builtin_cpu_supports("avx2");
+	return avx2 ? scan_avx2(words, w, end) : scan_sse2(words, w, end);
+#else
+	return scan_portable(words, w, end);
+#endif
+}
+
+// returns first 0 bit in [from, hi), -1 if none
+static int find_range(struct bitmap *bm, int from, int hi)
+{
+	if (from >= hi)
+		return -1;
+
+	// first, partial word
+	int w = from / 64;
+	bm->probes++;
+	uint64_t free = ~bm->words[w] & (~0ULL << (from % 64));
+	if (free) {
+		int i = w * 64 + __builtin_ctzll(free);
+		return i < hi ? i : -1;
+	}
+
+	// then whole words
+	int end = (hi + 63) / 64, first = w + 1;
+	w = scan(bm->words, first, end);
+	bm->probes += (w < end ? w + 1 : end) - first;
+	if (w == end)
+		return -1;
+	int i = w * 64 + __builtin_ctzll(~bm->words[w]);
+	return i < hi ? i : -1;
+}
+
+int bitmap_find(struct bitmap *bm, int from, int lo, int hi)
+{
+	int i;
+
+	if (bm->nfree == 0)
+		return -1;
+	if (from < lo || from >= hi)
+		from = lo;
+	if ((i = find_range(bm, from, hi)) != -1)
+		return i;
+	return find_range(bm, lo, from);
+}
+
+// returns start of first run of n 0 bits within [from, hi), -1 if none
+static int findrun_range(struct bitmap *bm, int n, int from, int hi)
+{
+	int i = from, j;
+
+	while ((i = find_range(bm, i, hi)) != -1) {
+		// measure run starting at i, a word at a time when aligned
+		for (j = i; j < hi && j - i < n; ) {
+			if (j % 64 == 0 && j + 64 <= hi && bm->words[j / 64] == 0) {
+				j += 64;
+			} else if (!bitmap_test(bm, j)) {
+				++j;
+			} else {
+				break;
+			}
+		}
+		if (j - i >= n)
+			return i;
+		if (j >= hi)
+			return -1;
+		i = j + 1; // j is allocated
+	}
+
+	return -1;
+}
+
+int bitmap_findrun(struct bitmap *bm, int n, int from, int lo, int hi)
+{
+	int i;
+
+	if (n <= 0 || bm->nfree < n)
+		return -1;
+	if (from < lo || from >= hi)
+		from = lo;
+	if ((i = findrun_range(bm, n, from, hi)) != -1)
+		return i;
+
+	// runs may not wrap around, but may cross from
+	i = findrun_range(bm, n, lo, from + n - 1 < hi ? from + n - 1 : hi);
+	return i;
+}
@@ -0,0 +1,37 @@
+/*
+ * Free block bitmap, 1 bits for allocated blocks
+ */
+
+#ifndef __BITMAP_H
+#define __BITMAP_H
+
+#include <stdint.h>
+
+struct bitmap {
+	uint64_t *words;
+	int nbits;
+	int nwords;
+	int nfree; // number of 0 bits
+	long probes; // words examined by searches
+};
+
+// all bits initially 0
+int bitmap_init(struct bitmap *, int nbits);
+
+// same as bitmap_init, using words, which holds (nbits + 63) / 64 zeroed words, instead of allocating them
+// words may be in shared memory, then bitmap_free must not be called
+void bitmap_attach(struct bitmap *, int nbits, uint64_t *words);
+
+void bitmap_free(struct bitmap *);
+
+int bitmap_test(struct bitmap *, int i);
+void bitmap_set(struct bitmap *, int i);
+void bitmap_clear(struct bitmap *, int i);
+
+// returns first 0 bit in [from, hi), else first in [lo, from), -1 if none
+int bitmap_find(struct bitmap *, int from, int lo, int hi);
+
+// returns start of first run of n 0 bits within [from, hi), else within [lo, from), -1 if none
+int bitmap_findrun(struct bitmap *, int n, int from, int lo, int hi);
+
+#endif
@@ -0,0 +1,44 @@
+#include <stdlib.h>
+
+#include "blockmap.h"
+
+void bmap_init(struct blockmap *map)
+{
+	map->blocks = NULL;
+	map->count = map->cap = 0;
+}
+
+void bmap_free(struct blockmap *map)
+{
+	free(map->blocks);
+	bmap_init(map);
+}
+
+BLOCKTYPE bmap_get(struct blockmap *map, int i)
+{
+	if (i < 0 || i >= map->count)
+		return 0;
+	return map->blocks[i];
+}
+
+int bmap_append(struct blockmap *map, BLOCKTYPE blk)
+{
+	// grow geometrically
+	if (map->count == map->cap) {
+		int cap = map->cap ? 2 * map->cap : 16;
+		BLOCKTYPE *blocks = realloc(map->blocks, cap * sizeof(BLOCKTYPE));
+		if (blocks == NULL)
+			return -1;
+		map->blocks = blocks;
+		map->cap = cap;
+	}
+
+	map->blocks[map->count++] = blk;
+	return 0;
+}
+
+void bmap_truncate(struct blockmap *map, int count)
+{
+	if (count < map->count)
+		map->count = count;
+}
@@ -0,0 +1,29 @@
+/*
+ * In-memory map from logical to physical blocks of a file, built from its FAT chain
+ */
+
+#ifndef __BLOCKMAP_H
+#define __BLOCKMAP_H
+
+#include "dir.h"
+
+struct blockmap {
+	BLOCKTYPE *blocks; // blocks[i]: physical block holding logical block i of file
+	int count;         // number of blocks in chain
+	int cap;           // allocated size of blocks
+};
+
+void bmap_init(struct blockmap *);
+
+void bmap_free(struct blockmap *);
+
+// returns physical block of logical block i, 0 if file has no such block
+BLOCKTYPE bmap_get(struct blockmap *, int i);
+
+// adds blk to the end of the chain
+int bmap_append(struct blockmap *, BLOCKTYPE blk);
+
+// drops every block after the first count blocks
+void bmap_truncate(struct blockmap *, int count);
+
+#endif
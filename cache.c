@@ -0,0 +1,584 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define HASH(c, blk) ((unsigned) (blk) % (c)->nbuckets)
+
+int cache_lookup(struct cache *cache, int blocknum);
+int cache_get(struct cache *cache, int blocknum, int load);
+int cache_evict(struct cache *cache, int wait);
+int cache_fill(struct cache *cache, struct ioq_req *reqs, int n);
+void cache_filled(struct cache *cache, struct ioq_req *reqs, int n);
+void cache_prefetched(struct ioq_req *reqs, int n, int res, void *arg);
+void cache_link(struct cache *cache, int i, int blocknum);
+void cache_unlink(struct cache *cache, int i);
+
+size_t cache_size(int nframes, int blocksize)
+{
+	return (size_t) nframes * (blocksize + sizeof(struct cache_frame) + 2 * sizeof(int));
+}
+
+int cache_init(struct cache *cache, int nframes, int blocksize, void *mem, int shared)
+{
+	if (nframes <= 0 || mem == NULL)
+		return -1;
+
+	// frame data first, keeping it aligned as mem is
+	cache->nframes  = nframes;
+	cache->blocksize = blocksize;
+	cache->nbuckets = 2 * nframes;
+	cache->data     = mem;
+	cache->frames   = (struct cache_frame *) (cache->data + (size_t) nframes * blocksize);
+	cache->buckets  = (int *) (cache->frames + nframes);
+
+	for (int i = 0; i < nframes; ++i) {
+		cache->frames[i].blocknum = -1;
+		cache->frames[i].dirty = cache->frames[i].ref = cache->frames[i].busy = 0;
+		cache->frames[i].next = -1;
+	}
+	memset(cache->buckets, -1, cache->nbuckets * sizeof(int));
+	cache->hand = 0;
+	cache->hits = cache->misses = cache->writebacks = 0;
+	mutex_init(&cache->lock, shared);
+	cond_init(&cache->done, shared);
+
+	return 0;
+}
+
+int cache_destroy(struct cache *cache)
+{
+	int res = cache_flush(cache);
+
+	cache->frames = NULL;
+	cache->data = NULL;
+	cache->buckets = NULL;
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->done);
+
+	return res;
+}
+
+int cache_read(struct cache *cache, int blocknum, void *buf)
+{
+	mutex_lock(&cache->lock);
+	int i = cache_get(cache, blocknum, 1);
+	if (i != -1) {
+		cache->frames[i].ref = 1;
+		memcpy(buf, cache->data + (size_t) i * cache->blocksize, cache->blocksize);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return i == -1 ? -1 : 0;
+}
+
+int cache_readblocks(struct cache *cache, int *blocknums, int count, void *buf)
+{
+	// frames of requested blocks not yet read, to be copied into buf after their batch completes
+	int *pending = malloc(count * sizeof(int));
+	int nreqs = 0, reserved = 0, res = 0, i, k, j, first = 0, fill = 0;
+	int maxreserve = cache->nframes / 2 ?: 1;
+	struct ioq_req *reqs = malloc((count < maxreserve ? count : maxreserve) * sizeof(struct ioq_req));
+
+	mutex_lock(&cache->lock);
+	for (k = 0; k <= count && !res; ++k) {
+		// read batch if all requested blocks are reserved, too many frames are reserved
+		// or no frame can be reserved until this batch completes
+		if (k == count || reserved == maxreserve || fill) {
+			res = cache_fill(cache, reqs, nreqs);
+			for (j = first; j < k && !res && buf; ++j) {
+				if (pending[j] == -1)
+					continue;
+
+				// frames being read by another thread are waited for, and read again if they were evicted since
+				i = pending[j];
+				while (cache->frames[i].busy && cache->frames[i].blocknum == blocknums[j])
+					cond_wait(&cache->done, &cache->lock);
+				if (cache->frames[i].blocknum != blocknums[j] && (i = cache_get(cache, blocknums[j], 1)) == -1) {
+					res = -1;
+					break;
+				}
+				memcpy((char *) buf + (size_t) j * cache->blocksize, cache->data + (size_t) i * cache->blocksize, cache->blocksize);
+			}
+			nreqs = reserved = fill = 0;
+			first = k;
+			if (k == count)
+				break;
+		}
+
+		i = cache_lookup(cache, blocknums[k]);
+		if (i != -1) {
+			// frame may be busy as part of a batch, in which case it is copied after the current batch
+			cache->hits++;
+			cache->frames[i].ref = 1;
+			pending[k] = cache->frames[i].busy ? i : -1;
+			if (!cache->frames[i].busy && buf)
+				memcpy((char *) buf + (size_t) k * cache->blocksize, cache->data + (size_t) i * cache->blocksize, cache->blocksize);
+			continue;
+		}
+
+		// reserve a frame for block k, reading current batch first if every frame is busy
+		// waiting is only allowed while holding no reserved frames, and may let block k in
+		if ((i = cache_evict(cache, nreqs == 0)) == -1) {
+			if (nreqs == 0) {
+				res = -1;
+				break;
+			}
+			fill = 1;
+			--k;
+			continue;
+		}
+		if (cache_lookup(cache, blocknums[k]) != -1) {
+			--k;
+			continue;
+		}
+
+		cache->misses++;
+		cache->frames[i].busy = 1;
+		cache->frames[i].ref = 1;
+		cache_link(cache, i, blocknums[k]);
+		pending[k] = i;
+		reserved++;
+
+		// extend previous request if block is consecutive, else start a new one
+		struct ioq_req *req = nreqs ? &reqs[nreqs - 1] : NULL;
+		if (!req || req->blocknum + req->count != blocknums[k] || req->count == MAXIOV) {
+			req = &reqs[nreqs++];
+			req->blocknum = blocknums[k];
+			req->count = 0;
+			req->write = 0;
+		}
+		req->iov[req->count].iov_base = cache->data + (size_t) i * cache->blocksize;
+		req->iov[req->count++].iov_len = cache->blocksize;
+	}
+	if (res)
+		cache_fill(cache, reqs, nreqs); // release reserved frames
+	pthread_mutex_unlock(&cache->lock);
+
+	free(reqs);
+	free(pending);
+	return res;
+}
+
+int cache_prefetch(struct cache *cache, int *blocknums, int count)
+{
+	int nreqs = 0, reserved = 0, i;
+	int maxreserve = cache->nframes / 2 ?: 1;
+	struct ioq_req *reqs = malloc((count < maxreserve ? count : maxreserve) * sizeof(struct ioq_req));
+
+	mutex_lock(&cache->lock);
+	for (int k = 0; k < count && reserved < maxreserve; ++k) {
+		if (cache_lookup(cache, blocknums[k]) != -1)
+			continue;
+
+		// no waiting for busy frames, blocks left out are read when needed
+		if ((i = cache_evict(cache, 0)) == -1)
+			break;
+		if (cache_lookup(cache, blocknums[k]) != -1) {
+			--k;
+			continue;
+		}
+
+		cache->misses++;
+		cache->frames[i].busy = 1;
+		cache->frames[i].ref = 1;
+		cache_link(cache, i, blocknums[k]);
+		reserved++;
+
+		struct ioq_req *req = nreqs ? &reqs[nreqs - 1] : NULL;
+		if (!req || req->blocknum + req->count != blocknums[k] || req->count == MAXIOV) {
+			req = &reqs[nreqs++];
+			req->blocknum = blocknums[k];
+			req->count = 0;
+			req->write = 0;
+		}
+		req->iov[req->count].iov_base = cache->data + (size_t) i * cache->blocksize;
+		req->iov[req->count++].iov_len = cache->blocksize;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (nreqs == 0)
+		free(reqs);
+	else
+		ioq_submitasync(reqs, nreqs, cache_prefetched, cache);
+	return 0;
+}
+
+// misses of cache_readthrough and cache_writethrough are batched at most IOQDEPTH requests at a time
+// and go to disk without holding the cache lock
+int cache_through(struct cache *cache, int *blocknums, int count, void *buf, int write)
+{
+	struct ioq_req *reqs = malloc(IOQDEPTH * sizeof(struct ioq_req));
+	int nreqs = 0, res = 0;
+
+	mutex_lock(&cache->lock);
+	for (int k = 0; k <= count && !res; ++k) {
+		if (k == count || nreqs == IOQDEPTH) {
+			pthread_mutex_unlock(&cache->lock);
+			if (ioq_submit(reqs, nreqs))
+				res = -1;
+			mutex_lock(&cache->lock);
+			nreqs = 0;
+			if (k == count)
+				break;
+		}
+
+		char *data = (char *) buf + (size_t) k * cache->blocksize;
+		int i = cache_lookup(cache, blocknums[k]);
+		if (i != -1 && cache->frames[i].busy) { // being read, look up again once done
+			cond_wait(&cache->done, &cache->lock);
+			--k;
+			continue;
+		}
+		if (i != -1) {
+			cache->hits++;
+			cache->frames[i].ref = 1;
+			if (write) {
+				memcpy(cache->data + (size_t) i * cache->blocksize, data, cache->blocksize);
+				cache->frames[i].dirty = 1;
+			} else {
+				memcpy(data, cache->data + (size_t) i * cache->blocksize, cache->blocksize);
+			}
+			continue;
+		}
+
+		// extend previous request if block is consecutive, else start a new one
+		cache->misses++;
+		struct ioq_req *req = nreqs ? &reqs[nreqs - 1] : NULL;
+		if (!req || req->blocknum + req->count != blocknums[k] || req->count == MAXIOV) {
+			if (nreqs == IOQDEPTH) { // submit full batch first
+				cache->misses--;
+				--k;
+				continue;
+			}
+			req = &reqs[nreqs++];
+			req->blocknum = blocknums[k];
+			req->count = 0;
+			req->write = write;
+		}
+		req->iov[req->count].iov_base = data;
+		req->iov[req->count++].iov_len = cache->blocksize;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	free(reqs);
+	return res;
+}
+
+int cache_readthrough(struct cache *cache, int *blocknums, int count, void *buf)
+{
+	return cache_through(cache, blocknums, count, buf, 0);
+}
+
+int cache_writethrough(struct cache *cache, int *blocknums, int count, void *buf)
+{
+	return cache_through(cache, blocknums, count, buf, 1);
+}
+
+// reads a batch of requests into reserved frames, unlinking them if not successful
+// cache lock is released during the reads
+int cache_fill(struct cache *cache, struct ioq_req *reqs, int n)
+{
+	if (n == 0)
+		return 0;
+
+	pthread_mutex_unlock(&cache->lock);
+	int res = ioq_submit(reqs, n);
+	mutex_lock(&cache->lock);
+	cache_filled(cache, reqs, n);
+
+	return res;
+}
+
+// releases frames of completed read requests, those that failed are left empty
+void cache_filled(struct cache *cache, struct ioq_req *reqs, int n)
+{
+	for (int r = 0; r < n; ++r) {
+		for (int j = 0; j < reqs[r].count; ++j) {
+			int i = ((char *) reqs[r].iov[j].iov_base - cache->data) / cache->blocksize;
+			cache->frames[i].busy = 0;
+			if (reqs[r].res)
+				cache_unlink(cache, i);
+		}
+	}
+	pthread_cond_broadcast(&cache->done);
+}
+
+// completion of batch of cache_prefetch, called without the cache lock
+void cache_prefetched(struct ioq_req *reqs, int n, int res, void *arg)
+{
+	struct cache *cache = arg;
+
+	mutex_lock(&cache->lock);
+	cache_filled(cache, reqs, n);
+	pthread_mutex_unlock(&cache->lock);
+	free(reqs);
+}
+
+int cache_write(struct cache *cache, int blocknum, void *buf)
+{
+	// whole block is overwritten, no need to read it first
+	mutex_lock(&cache->lock);
+	int i = cache_get(cache, blocknum, 0);
+	if (i != -1) {
+		cache->frames[i].ref = 1;
+		cache->frames[i].dirty = 1;
+		memcpy(cache->data + (size_t) i * cache->blocksize, buf, cache->blocksize);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return i == -1 ? -1 : 0;
+}
+
+struct flush_entry {
+	int blocknum;
+	int frame;
+};
+
+int cmp_flush(const void *a, const void *b)
+{
+	return ((struct flush_entry *) a)->blocknum - ((struct flush_entry *) b)->blocknum;
+}
+
+// writes back the n dirty frames listed in order, sorting them by block, holding cache lock
+// lock is released during the writes, frames being written are busy meanwhile
+int cache_writeback(struct cache *cache, struct flush_entry *order, int n)
+{
+	int res;
+
+	if (n == 0)
+		return 0;
+	qsort(order, n, sizeof(struct flush_entry), cmp_flush);
+
+	// write runs of consecutive blocks together, all runs in a single batch
+	struct ioq_req *reqs = malloc((n ?: 1) * sizeof(struct ioq_req));
+	int nreqs = 0;
+	for (int k = 0; k < n; ++k) {
+		struct ioq_req *req = nreqs ? &reqs[nreqs - 1] : NULL;
+		if (!req || req->blocknum + req->count != order[k].blocknum || req->count == MAXIOV) {
+			req = &reqs[nreqs++];
+			req->blocknum = order[k].blocknum;
+			req->count = 0;
+			req->write = 1;
+		}
+		req->iov[req->count].iov_base = cache->data + (size_t) order[k].frame * cache->blocksize;
+		req->iov[req->count++].iov_len = cache->blocksize;
+		cache->frames[order[k].frame].busy = 1;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	res = ioq_submit(reqs, nreqs);
+	mutex_lock(&cache->lock);
+
+	for (int r = 0, k = 0; r < nreqs; k += reqs[r++].count) {
+		for (int j = k; j < k + reqs[r].count; ++j) {
+			cache->frames[order[j].frame].busy = 0;
+			if (!reqs[r].res)
+				cache->frames[order[j].frame].dirty = 0;
+		}
+		if (!reqs[r].res)
+			cache->writebacks += reqs[r].count;
+	}
+	pthread_cond_broadcast(&cache->done);
+	free(reqs);
+	return res;
+}
+
+int cache_flush(struct cache *cache)
+{
+	return cache_flushrange(cache, 0, INT_MAX);
+}
+
+int cache_flushrange(struct cache *cache, int from, int to)
+{
+	// collect dirty frames, then write them in increasing block order
+	struct flush_entry *order = malloc(cache->nframes * sizeof(struct flush_entry));
+	int n = 0, res;
+
+	mutex_lock(&cache->lock);
+	for (int i = 0; i < cache->nframes; ++i) {
+		int b = cache->frames[i].blocknum;
+		if (cache->frames[i].dirty && b >= from && b < to) {
+			// frame being written back by another thread, collected again once it is done
+			if (cache->frames[i].busy) {
+				cond_wait(&cache->done, &cache->lock);
+				n = 0;
+				i = -1;
+				continue;
+			}
+			order[n].blocknum = b;
+			order[n++].frame = i;
+		}
+	}
+	res = cache_writeback(cache, order, n);
+	pthread_mutex_unlock(&cache->lock);
+
+	free(order);
+	return res;
+}
+
+int cache_flushblocks(struct cache *cache, int *blocknums, int count)
+{
+	struct flush_entry *order = malloc((count ?: 1) * sizeof(struct flush_entry));
+	int n = 0, res;
+
+	mutex_lock(&cache->lock);
+	for (int k = 0; k < count; ++k) {
+		int i = cache_lookup(cache, blocknums[k]);
+		if (i != -1 && cache->frames[i].dirty && cache->frames[i].busy) { // see cache_flushrange
+			cond_wait(&cache->done, &cache->lock);
+			n = 0;
+			k = -1;
+			continue;
+		}
+		if (i != -1 && cache->frames[i].dirty) {
+			order[n].blocknum = blocknums[k];
+			order[n++].frame = i;
+		}
+	}
+	res = cache_writeback(cache, order, n);
+	pthread_mutex_unlock(&cache->lock);
+
+	free(order);
+	return res;
+}
+
+int cache_drop(struct cache *cache, int *blocknums, int count)
+{
+	int res = cache_flushblocks(cache, blocknums, count);
+
+	// frames being read are dropped once done
+	mutex_lock(&cache->lock);
+	for (int k = 0; k < count; ++k) {
+		int i = cache_lookup(cache, blocknums[k]);
+		if (i != -1 && cache->frames[i].busy) {
+			cond_wait(&cache->done, &cache->lock);
+			--k;
+			continue;
+		}
+		if (i != -1 && !cache->frames[i].dirty)
+			cache_unlink(cache, i);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return res;
+}
+
+int cache_lookup(struct cache *cache, int blocknum)
+{
+	int i = cache->buckets[HASH(cache, blocknum)];
+	while (i != -1 && cache->frames[i].blocknum != blocknum)
+		i = cache->frames[i].next;
+	return i;
+}
+
+// returns frame holding blocknum, reading it from disk if not cached and load is set
+// waits for frames being read by other threads, cache lock is released while reading
+int cache_get(struct cache *cache, int blocknum, int load)
+{
+	int i, res;
+
+	for (;;) {
+		i = cache_lookup(cache, blocknum);
+		if (i != -1 && cache->frames[i].busy) {
+			cond_wait(&cache->done, &cache->lock);
+			continue;
+		}
+		if (i != -1) {
+			cache->hits++;
+			return i;
+		}
+
+		// block may have been read by another thread while waiting for a frame
+		if ((i = cache_evict(cache, 1)) == -1)
+			return -1;
+		if (cache_lookup(cache, blocknum) == -1)
+			break;
+	}
+
+	cache->misses++;
+	cache_link(cache, i, blocknum);
+	if (!load)
+		return i;
+
+	cache->frames[i].busy = 1;
+	pthread_mutex_unlock(&cache->lock);
+	res = getblock(blocknum, cache->data + (size_t) i * cache->blocksize);
+	mutex_lock(&cache->lock);
+	cache->frames[i].busy = 0;
+	pthread_cond_broadcast(&cache->done);
+
+	if (res) {
+		cache_unlink(cache, i);
+		return -1;
+	}
+	return i;
+}
+
+// returns a free frame, writing back and unlinking its previous block if necessary
+// if every frame is busy, waits for one if wait is set, else returns -1
+int cache_evict(struct cache *cache, int wait)
+{
+	struct cache_frame *frame;
+	int i, n = 0;
+
+	// advance hand until a frame with cleared reference bit is found
+	for (;;) {
+		i = cache->hand;
+		frame = &cache->frames[i];
+		cache->hand = (cache->hand + 1) % cache->nframes;
+		if (frame->busy) {
+			// two sweeps over busy frames only
+			if (++n < 2 * cache->nframes)
+				continue;
+			if (!wait)
+				return -1;
+			cond_wait(&cache->done, &cache->lock);
+			n = 0;
+			continue;
+		}
+		if (frame->blocknum == -1 || !frame->ref)
+			break;
+		frame->ref = 0;
+	}
+
+	if (frame->blocknum == -1)
+		return i;
+
+	// written back without the lock, the frame stays linked and busy meanwhile
+	if (frame->dirty) {
+		frame->busy = 1;
+		pthread_mutex_unlock(&cache->lock);
+		int res = putblock(frame->blocknum, cache->data + (size_t) i * cache->blocksize);
+		mutex_lock(&cache->lock);
+		frame->busy = 0;
+		pthread_cond_broadcast(&cache->done);
+		if (res)
+			return -1;
+		frame->dirty = 0;
+		cache->writebacks++;
+	}
+
+	cache_unlink(cache, i);
+	return i;
+}
+
+// links frame i to hash chain of blocknum
+void cache_link(struct cache *cache, int i, int blocknum)
+{
+	cache->frames[i].blocknum = blocknum;
+	cache->frames[i].next = cache->buckets[HASH(cache, blocknum)];
+	cache->buckets[HASH(cache, blocknum)] = i;
+}
+
+// unlinks frame i from its hash chain, leaving it empty
+void cache_unlink(struct cache *cache, int i)
+{
+	int *p = &cache->buckets[HASH(cache, cache->frames[i].blocknum)];
+	while (*p != i)
+		p = &cache->frames[*p].next;
+	*p = cache->frames[i].next;
+	cache->frames[i].blocknum = -1;
+	cache->frames[i].next = -1;
+}
@@ -0,0 +1,84 @@
+/*
+ * Block buffer cache between file system and virtual disk
+ */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <pthread.h>
+
+#include "myfs.h"
+#include "ioqueue.h"
+#include "lock.h"
+
+// raw disk access, implemented in myfs.c
+int getblock(int blocknum, void *buf);
+int putblock(int blocknum, void *buf);
+int getblocks(int blocknum, int count, void **bufs);
+int putblocks(int blocknum, int count, void **bufs);
+
+struct cache {
+	struct cache_frame {
+		int blocknum; // -1 if frame is empty
+		char dirty;   // must be written back before eviction
+		char ref;     // reference bit for CLOCK eviction
+		char busy;    // being filled or written back, may not be evicted
+		int next;     // next frame in hash chain, -1 if last
+	} *frames;
+	char *data;    // nframes * blocksize bytes, frame i at data + i * blocksize
+	int *buckets;  // hash table from block number to first frame in chain
+	int nframes;
+	int blocksize;
+	int nbuckets;
+	int hand;      // CLOCK hand
+	long hits, misses, writebacks;
+	pthread_mutex_t lock;  // held for every operation, released while reading or writing busy frames
+	pthread_cond_t done;   // signalled when busy frames are filled or written back
+};
+
+// bytes of memory needed by cache of nframes frames
+size_t cache_size(int nframes, int blocksize);
+
+// sets up cache in mem, which holds cache_size(nframes, blocksize) bytes
+// if shared, mem is shared memory mapped at the same address by every process using the cache
+int cache_init(struct cache *, int nframes, int blocksize, void *mem, int shared);
+
+// writes back all dirty frames, memory of cache is left to its owner
+int cache_destroy(struct cache *);
+
+// copies block blocknum into buf, loading it from disk if not cached
+int cache_read(struct cache *, int blocknum, void *buf);
+
+// copies blocks blocknums[0..count-1] into consecutive blocks of buf
+// missing blocks consecutive on disk are read with a single I/O, all such I/Os submitted in one batch
+// if buf is NULL, blocks are only loaded into the cache
+int cache_readblocks(struct cache *, int *blocknums, int count, void *buf);
+
+// starts loading missing blocks of blocknums[0..count-1] into the cache and returns without waiting,
+// their frames stay busy until read; blocks for which no frame is free are left out
+int cache_prefetch(struct cache *, int *blocknums, int count);
+
+// same as cache_readblocks, but missing blocks are read directly into buf without being cached
+int cache_readthrough(struct cache *, int *blocknums, int count, void *buf);
+
+// writes consecutive blocks of buf into blocknums[0..count-1], updating cached blocks in place
+// and writing the rest directly to disk
+int cache_writethrough(struct cache *, int *blocknums, int count, void *buf);
+
+// copies buf into the frame of block blocknum and marks it dirty, without reading it from disk
+int cache_write(struct cache *, int blocknum, void *buf);
+
+// writes back all dirty frames in order of block number, consecutive blocks with a single I/O,
+// all such I/Os submitted in one batch
+int cache_flush(struct cache *);
+
+// same as cache_flush, only for blocks from from up to but not including to,
+// or only for blocks blocknums[0..count-1], which must be distinct
+int cache_flushrange(struct cache *, int from, int to);
+int cache_flushblocks(struct cache *, int *blocknums, int count);
+
+// writes back blocks blocknums[0..count-1] if dirty and drops them from the cache,
+// before they are written to disk around it
+int cache_drop(struct cache *, int *blocknums, int count);
+
+#endif
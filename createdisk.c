@@ -11,10 +11,9 @@
 
 int main (int argc, char *argv[])
 {
-	int n, size ,ret, i;
+	int size;
 	int fd;  
 	char vdiskname[128]; 
-	char buf[BLOCKSIZE];     
 	int numblocks = 0; 
 
 	if (argc != 2) {
@@ -29,22 +28,17 @@ int main (int argc, char *argv[])
 	printf ("diskname=%s size=%d blocks=%d\n", 
 		vdiskname, size, numblocks); 
        
-	ret = open (vdiskname,  O_CREAT | O_RDWR, 0666); 	
-	if (ret == -1) {
+	fd = open (vdiskname,  O_CREAT | O_RDWR, 0666); 	
+	if (fd == -1) {
 		printf ("could not create disk\n"); 
 		exit(1); 
 	}
 	
-	bzero ((void *)buf, BLOCKSIZE); 
-	fd = open (vdiskname, O_RDWR); 
-	for (i=0; i < (size / BLOCKSIZE); ++i) {
-		printf ("block=%d\n", i); 
-		n = write (fd, buf, BLOCKSIZE); 
-		if (n != BLOCKSIZE) {
-			printf ("write error\n"); 
-			exit (1); 
-		}
-	}	
+	// sparse file of zeros, blocks are allocated by the host file system once written
+	if (ftruncate (fd, 0) || ftruncate (fd, size)) {
+		printf ("write error\n"); 
+		exit (1); 
+	}
 	close (fd); 
 	
 	printf ("created a virtual disk=%s of size=%d\n", vdiskname, size);	
@@ -1,19 +1,67 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "dir.h"
 
-int getindex(struct dir *dir, char *filename);
+int getindex(struct dir *dir, char *filename, uint32_t hash, int *slot);
+uint32_t hashname(char *filename);
+
+// offsets of arrays in on-disk directory, each aligned to 8 bytes
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+#define ENTRIESOFF      ALIGN8(sizeof(struct dir_header))
+#define FCBSOFF(n)     (ENTRIESOFF + ALIGN8((n) * sizeof(struct dir_entry)))
+#define INDEXOFF(n)    (FCBSOFF(n) + ALIGN8((n) * sizeof(struct fcb_entry)))
+
+int dir_slots(int maxfiles)
+{
+	int n = 2;
+	while (n < 2 * maxfiles)
+		n *= 2;
+	return n;
+}
+
+size_t dir_size(int maxfiles)
+{
+	return INDEXOFF(maxfiles) + dir_slots(maxfiles) * sizeof(uint32_t);
+}
+
+int dir_maxfiles(size_t size)
+{
+	int lo = 0, hi = size / sizeof(struct dir_entry);
+
+	// dir_size grows with maxfiles, so search for the last count that fits
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (dir_size(mid) <= size)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+void dir_attach(struct dir *dir, void *buf, int maxfiles)
+{
+	dir->buf = buf;
+	dir->hdr = buf;
+	dir->entries = (struct dir_entry *) ((char *) buf + ENTRIESOFF);
+	dir->fcbs = (struct fcb_entry *) ((char *) buf + FCBSOFF(maxfiles));
+	dir->index = (uint32_t *) ((char *) buf + INDEXOFF(maxfiles));
+	dir->maxfiles = maxfiles;
+	dir->nslots = dir_slots(maxfiles);
+}
 
 void dir_init(struct dir *dir)
 {
-	// fill struct with zeros
-	memset(&dir, 0, sizeof(dir));
+	// fill table with zeros
+	memset(dir->buf, 0, dir_size(dir->maxfiles));
 }
 
 int dir_get(struct dir *dir, char *filename)
 {
-	int i = getindex(dir, filename);
+	int slot;
+	int i = getindex(dir, filename, hashname(filename), &slot);
 	if (i == -1)
 		return -1;
 	return dir->entries[i].inum;
@@ -22,82 +70,143 @@ int dir_get(struct dir *dir, char *filename)
 // size 0
 int dir_add(struct dir *dir, char *filename)
 {
-	if (dir->filenum == MAXFILECOUNT)
+	if (dir->hdr->filenum == dir->maxfiles || dir->hdr->minfree == -1)
 		return -1;
 
-	// similar to get, locates predecessor or successor of filename
-	int i = 0, j = dir->filenum - 1, k = dir->filenum, cmp = 0;
-	while (i <= j) {
-		k = (i + j) / 2;
-		cmp = strcmp(dir->entries[k].filename, filename);
-		if (cmp == 0) return -1; // file already exists
-		else if (cmp < 0) i = k + 1;
-		else j = k - 1;
-	}
+	// locates filename, or the empty slot it would be placed in
+	uint32_t hash = hashname(filename);
+	int slot;
+	if (getindex(dir, filename, hash, &slot) != -1)
+		return -1; // file already exists
 
-	// create new entry, shift succeeding entries
-	// k: index of new entry, should be incremented if last element was the predecessor of new file
-	if (cmp < 0) k = i;
-	for (j = dir->filenum - 1; k <= j; --j)
-		dir->entries[j+1] = dir->entries[j]; // struct copy
+	// create new entry at end of entries
+	int k = dir->hdr->filenum;
 	strcpy(dir->entries[k].filename, filename);
+	dir->entries[k].hash = hash;
+	dir->index[slot] = k + 1;
 
 	// printf("added %s to entry %d in dir\n", filename, k);
 
 	// find free entry in FCB table
-	i = dir->minfree;
+	int i = dir->hdr->minfree;
 
 	// initialize FCB
 	dir->fcbs[i].valid = 1;
 	dir->entries[k].inum = i;
 	dir->fcbs[i].inode.size = dir->fcbs[i].inode.start = 0;
 
-	dir->filenum++;
-	dir->minfree++;
-	while (dir->minfree != i && dir->fcbs[dir->minfree].valid)
-		dir->minfree = (dir->minfree + 1) % MAXFILECOUNT;
-	if (dir->minfree == i)
-		dir->minfree = -1;
+	dir->hdr->filenum++;
+	dir->hdr->minfree = (dir->hdr->minfree + 1) % dir->maxfiles;
+	while (dir->hdr->minfree != i && dir->fcbs[dir->hdr->minfree].valid)
+		dir->hdr->minfree = (dir->hdr->minfree + 1) % dir->maxfiles;
+	if (dir->hdr->minfree == i)
+		dir->hdr->minfree = -1;
 
-	// printf("added file to inode %d, new minfree = %d\n", i, dir->minfree);
+	// printf("added file to inode %d, new minfree = %d\n", i, dir->hdr->minfree);
 
 	return k;
 }
 
 // doesn't delete blocks
-int dir_remove(struct dir *dir, char *filename, struct inode *inode)
+// removes entry of filename, leaving its fcb as it is, returns inum
+static int removeentry(struct dir *dir, char *filename)
 {
-	int i = getindex(dir, filename);
+	int slot;
+	int i = getindex(dir, filename, hashname(filename), &slot);
 	if (i == -1)
 		return -1;
 	int inum = dir->entries[i].inum;
-	*inode = dir->fcbs[inum].inode; // struct copy
-	dir->fcbs[inum].valid = 0;
 
-	// shift elements after i
-	for (; i < dir->filenum - 1; ++i)
-		dir->entries[i] = dir->entries[i+1];
+	// empty slot, moving back later slots of its probe sequence that may no longer be reached
+	int j = slot;
+	dir->index[slot] = 0;
+	for (;;) {
+		j = (j + 1) % dir->nslots;
+		if (dir->index[j] == 0)
+			break;
+		int home = dir->entries[dir->index[j] - 1].hash % dir->nslots;
+		if ((j > slot && (home <= slot || home > j)) || (j < slot && home <= slot && home > j)) {
+			dir->index[slot] = dir->index[j];
+			dir->index[j] = 0;
+			slot = j;
+		}
+	}
 
-	dir->filenum--;
-	if (dir->minfree == -1 || inum < dir->minfree)
-		dir->minfree = inum;
+	// move last entry into place of removed one
+	int last = --dir->hdr->filenum;
+	if (i != last) {
+		getindex(dir, dir->entries[last].filename, dir->entries[last].hash, &slot);
+		dir->entries[i] = dir->entries[last]; // struct copy
+		dir->index[slot] = i + 1;
+	}
 
 	return inum;
 }
 
-int getindex(struct dir *dir, char *filename)
+int dir_remove(struct dir *dir, char *filename, struct inode *inode)
 {
-	int i = 0, j = dir->filenum - 1, k, cmp;
-	while (i <= j) {
-		k = (i + j) / 2;
-		cmp = strcmp(dir->entries[k].filename, filename);
-		if (cmp == 0)
+	int inum = removeentry(dir, filename);
+	if (inum == -1)
+		return -1;
+	*inode = dir->fcbs[inum].inode; // struct copy
+	dir_freefcb(dir, inum);
+	return inum;
+}
+
+int dir_unlink(struct dir *dir, char *filename)
+{
+	int inum = removeentry(dir, filename);
+	if (inum != -1)
+		dir->fcbs[inum].valid = FCB_ORPHAN;
+	return inum;
+}
+
+void dir_freefcb(struct dir *dir, int inum)
+{
+	dir->fcbs[inum].valid = 0;
+	if (dir->hdr->minfree == -1 || inum < dir->hdr->minfree)
+		dir->hdr->minfree = inum;
+}
+
+int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+void dir_sorted(struct dir *dir, int *order)
+{
+	// sort pointers to names, then turn them back into indices
+	char **names = malloc(dir->hdr->filenum * sizeof(char *));
+	for (int i = 0; i < dir->hdr->filenum; ++i)
+		names[i] = dir->entries[i].filename;
+	qsort(names, dir->hdr->filenum, sizeof(char *), cmp_name);
+	for (int i = 0; i < dir->hdr->filenum; ++i)
+		order[i] = (struct dir_entry *) (names[i] - offsetof(struct dir_entry, filename)) - dir->entries;
+	free(names);
+}
+
+// returns index of entry with filename, -1 if none; slot is set to its slot in index, or the empty slot ending its probe sequence
+int getindex(struct dir *dir, char *filename, uint32_t hash, int *slot)
+{
+	int j = hash % dir->nslots, k;
+	while ((k = dir->index[j]) != 0) {
+		k--;
+		if (dir->entries[k].hash == hash && !strcmp(dir->entries[k].filename, filename)) {
+			*slot = j;
 			return k;
-		else if (cmp < 0)
-			i = k + 1;
-		else
-			j = k - 1;
+		}
+		j = (j + 1) % dir->nslots;
 	}
 
+	*slot = j;
 	return -1;
 }
+
+// FNV-1a
+uint32_t hashname(char *filename)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < MAXFILENAMESIZE && filename[i]; ++i)
+		hash = (hash ^ (unsigned char) filename[i]) * 16777619u;
+	return hash;
+}
@@ -5,39 +5,74 @@
 #ifndef __DIR_H
 #define __DIR_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "myfs.h"
 
-#define BLOCKTYPE uint16_t
+#define BLOCKTYPE uint32_t
 
-struct dir {
-	struct dir_entry {
-		char filename[MAXFILENAMESIZE];
-		int inum; // index of fcb in table
-	} entries[MAXFILECOUNT];
-	struct fcb_entry {
-		uint8_t valid;
-		struct inode {
-			int size;
-			BLOCKTYPE start; // index of first data block
-		} inode;
-	} fcbs[MAXFILECOUNT]; // kept separate from entries as entries may be moved after deletion
+struct dir_entry {
+	char filename[MAXFILENAMESIZE];
+	uint32_t hash; // hash of filename
+	int inum; // index of fcb in table
+};
+
+// valid fcb of a file removed from directory, whose blocks are yet to be freed
+#define FCB_ORPHAN 2
+
+struct fcb_entry {
+	uint8_t valid;
+	struct inode {
+		int64_t size;
+		BLOCKTYPE start; // index of first data block
+	} inode;
+};
+
+// on-disk directory starts with this header, followed by entries, fcbs and index
+struct dir_header {
 	int filenum;
 	int minfree; // first available fcb
 };
 
+// directory of maxfiles files, pointing into a buffer laid out as on disk
+struct dir {
+	void *buf;
+	struct dir_header *hdr;
+	struct dir_entry *entries; // unordered, first filenum entries are used
+	struct fcb_entry *fcbs; // kept separate from entries as entries may be moved after deletion
+	uint32_t *index; // open addressing on filename hash, entry index + 1 or 0 if slot is empty
+	int maxfiles;
+	int nslots; // slots of index, power of 2 and at most half full
+};
+
+// size of on-disk directory of maxfiles files
+size_t dir_size(int maxfiles);
+
+// largest maxfiles whose on-disk directory fits in size bytes
+int dir_maxfiles(size_t size);
 
+// sets up dir for buf of dir_size(maxfiles) bytes, an all-zero buffer is an empty directory
+void dir_attach(struct dir *, void *buf, int maxfiles);
 
 void dir_init(struct dir *);
 
 // returns inum
 int dir_get(struct dir *, char *filename);
 
-// size 0, return inum
+// size 0, returns index of new entry, whose inum is that of its fcb, -1 if full or filename exists
 int dir_add(struct dir *, char *filename);
 
 // doesn't delete blocks, does invalidate fcb
 int dir_remove(struct dir *, char *filename, struct inode *inode);
 
+// same, but leaves fcb as FCB_ORPHAN until dir_freefcb, returns inum
+int dir_unlink(struct dir *, char *filename);
+
+// invalidates fcb of inum
+void dir_freefcb(struct dir *, int inum);
+
+// fills order with indices of the filenum entries, sorted by filename
+void dir_sorted(struct dir *, int *order);
+
 #endif
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent.h"
+
+void ext_init(struct extlist *list)
+{
+	list->ext = NULL;
+	list->count = list->cap = 0;
+	list->overflow = 0;
+}
+
+void ext_attach(struct extlist *list, struct extent *ext, int cap)
+{
+	list->ext = ext;
+	list->count = 0;
+	list->cap = cap;
+	list->overflow = 0;
+}
+
+int ext_copy(struct extlist *dst, struct extlist *src)
+{
+	if (src->count > dst->cap)
+		return -1;
+	memcpy(dst->ext, src->ext, src->count * sizeof(struct extent));
+	dst->count = src->count;
+	dst->overflow = src->overflow;
+	return 0;
+}
+
+void ext_free(struct extlist *list)
+{
+	free(list->ext);
+	ext_init(list);
+}
+
+int ext_blocks(struct extlist *list)
+{
+	int n = 0;
+	for (int i = 0; i < list->count; ++i)
+		n += list->ext[i].len;
+	return n;
+}
+
+// adds extent after last one, growing list unless it is full
+static int ext_add(struct extlist *list, BLOCKTYPE start, BLOCKTYPE len, int max)
+{
+	if (list->count == max)
+		return -1;
+	if (list->count == list->cap) {
+		int cap = list->cap ? 2 * list->cap : NDIRECTEXT;
+		struct extent *ext = realloc(list->ext, cap * sizeof(struct extent));
+		if (ext == NULL)
+			return -1;
+		list->ext = ext;
+		list->cap = cap;
+	}
+
+	list->ext[list->count].start = start;
+	list->ext[list->count++].len = len;
+	return 0;
+}
+
+int ext_append(struct extlist *list, BLOCKTYPE blk, int max)
+{
+	struct extent *last = list->count ? &list->ext[list->count - 1] : NULL;
+
+	// extend last extent if possible, a hole is never followed on
+	if (last && last->start && last->start + last->len == blk && last->len < (BLOCKTYPE) -1) {
+		last->len++;
+		return 0;
+	}
+	return ext_add(list, blk, 1, max);
+}
+
+int ext_appendhole(struct extlist *list, BLOCKTYPE n, int max)
+{
+	struct extent *last = list->count ? &list->ext[list->count - 1] : NULL;
+
+	if (last && last->start == 0 && last->len <= (BLOCKTYPE) -1 - n) {
+		last->len += n;
+		return 0;
+	}
+	return ext_add(list, 0, n, max);
+}
+
+void ext_truncate(struct extlist *list, int nblocks)
+{
+	int i;
+
+	for (i = 0; i < list->count && nblocks > 0; ++i) {
+		if (list->ext[i].len > nblocks)
+			list->ext[i].len = nblocks;
+		nblocks -= list->ext[i].len;
+	}
+	list->count = i;
+}
+
+// adds extent to the n pieces of an extent list, joining it to the last one if it follows it, or if both are holes
+static void ext_push(struct extent *pieces, int *n, BLOCKTYPE start, BLOCKTYPE len)
+{
+	struct extent *last = *n ? &pieces[*n - 1] : NULL;
+
+	if (last && (last->start == 0) == (start == 0) && (start == 0 || last->start + last->len == start) &&
+	    last->len <= (BLOCKTYPE) -1 - len) {
+		last->len += len;
+		return;
+	}
+	pieces[*n].start = start;
+	pieces[(*n)++].len = len;
+}
+
+int ext_replace(struct extlist *list, int i, BLOCKTYPE blk, int max)
+{
+	int e = 0;
+
+	while (e < list->count && (BLOCKTYPE) i >= list->ext[e].len)
+		i -= list->ext[e++].len;
+	if (e == list->count)
+		return -1;
+
+	// extent of block is split around it, blk may join the extents before and after it
+	struct extent pieces[5];
+	int from = e > 0 ? e - 1 : e, to = e + 1 < list->count ? e + 1 : e, n = 0;
+	for (int k = from; k <= to; ++k) {
+		struct extent x = list->ext[k];
+		if (k != e) {
+			ext_push(pieces, &n, x.start, x.len);
+			continue;
+		}
+		if (i > 0)
+			ext_push(pieces, &n, x.start, i);
+		ext_push(pieces, &n, blk, 1);
+		if ((BLOCKTYPE) i + 1 < x.len)
+			ext_push(pieces, &n, x.start ? x.start + i + 1 : 0, x.len - i - 1);
+	}
+
+	int count = list->count - (to - from + 1) + n;
+	if (count > max || count > list->cap)
+		return -1;
+	memmove(&list->ext[from + n], &list->ext[to + 1], (list->count - to - 1) * sizeof(struct extent));
+	memcpy(&list->ext[from], pieces, n * sizeof(struct extent));
+	list->count = count;
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Extent lists for the extent-based file layout
+ */
+
+#ifndef __EXTENT_H
+#define __EXTENT_H
+
+#include <stdint.h>
+
+#include "dir.h"
+
+#define NDIRECTEXT 7 // extents kept in extent table, rest kept in overflow block
+#define MAXEXTENTS(blocksize) (NDIRECTEXT + (blocksize) / sizeof(struct extent))
+
+struct extent {
+	BLOCKTYPE start; // first block, 0 for a hole of len blocks without data
+	BLOCKTYPE len;   // number of consecutive blocks
+};
+
+// on-disk entry of extent table, one for each FCB
+struct extent_entry {
+	BLOCKTYPE overflow; // block holding extents after the first NDIRECTEXT, 0 if none
+	uint32_t count;     // total number of extents
+	struct extent ext[NDIRECTEXT];
+};
+
+// in-memory extent list of a file
+struct extlist {
+	struct extent *ext;
+	int count;
+	int cap;
+	BLOCKTYPE overflow; // overflow block currently owned by file, 0 if none
+};
+
+void ext_init(struct extlist *);
+
+// list keeps its extents in ext, which has room for cap extents and is never reallocated
+// ext may be in shared memory, then ext_free must not be called
+void ext_attach(struct extlist *, struct extent *ext, int cap);
+
+// copies extents and overflow block of src into dst, returns -1 if dst has no room for them
+int ext_copy(struct extlist *dst, struct extlist *src);
+
+void ext_free(struct extlist *);
+
+// number of blocks covered by list, holes included
+int ext_blocks(struct extlist *);
+
+// adds blk after last block of list, extending last extent if blk directly follows it
+// returns -1 if list would need more than max extents
+int ext_append(struct extlist *, BLOCKTYPE blk, int max);
+
+// adds a hole of n blocks after last block of list, extending last extent if it is a hole
+// returns -1 if list would need more than max extents
+int ext_appendhole(struct extlist *, BLOCKTYPE n, int max);
+
+// keeps only the first nblocks blocks of list
+void ext_truncate(struct extlist *, int nblocks);
+
+// makes blk block i of list in place of the block it had, splitting extents as necessary
+// returns -1 if list would need more than max extents, or has no room for them
+int ext_replace(struct extlist *, int i, BLOCKTYPE blk, int max);
+
+#endif
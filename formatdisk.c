@@ -1,4 +1,3 @@
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,13 +9,32 @@
 int main (int argc, char *argv[])
 {
 	char vdiskname [128]; 
+	int64_t size = DISKSIZE;
+	int blocksize = BLOCKSIZE, maxfiles = MAXFILECOUNT, opts = 0, c;
+
+	// geometry options, disk size given in MB
+	while ((c = getopt(argc, argv, "s:b:n:")) != -1) {
+		switch (c) {
+		case 's': size = atoll(optarg) << 20; break;
+		case 'b': blocksize = atoi(optarg); break;
+		case 'n': maxfiles = atoi(optarg); break;
+		default: argc = 0;
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc != 2) {
-		printf ("usage: formatdisk <vdiskname>\n"); 
+	if (argc != 1 && (argc != 2 || strcmp(argv[1], "extents"))) {
+		printf ("usage: formatdisk [-s sizeMB] [-b blocksize] [-n maxfiles] <vdiskname> [extents]\n"); 
 		exit (1); 
 	}
+	if (argc == 2)
+		opts |= MYFS_EXTENTS;
 
-	strcpy (vdiskname, argv[1]); 
-	myfs_makefs (vdiskname); 
+	strcpy (vdiskname, argv[0]); 
+	if (myfs_makefsgeom (vdiskname, size, blocksize, maxfiles, opts)) {
+		printf ("could not format disk %s\n", vdiskname);
+		exit (1);
+	}
 	return (0); 
 }
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "myfs.h"
+
+// exit status as for fsck(8): 0 if no problems, 1 if all were repaired, 4 if some were left, 8 if disk could not be checked
+int main (int argc, char *argv[])
+{
+	struct myfs_check res;
+	struct timespec start, end;
+	int repair = 0, c;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "rj:")) != -1) {
+		switch (c) {
+		case 'r': repair = 1; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default: argc = 0;
+		}
+	}
+	if (argc - optind != 1 || nthreads < 1) {
+		printf ("usage: fsck [-r] [-j threads] <vdiskname>\n");
+		exit (8);
+	}
+	if (nthreads > 16)
+		nthreads = 16;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (myfs_check(argv[optind], repair, nthreads, &res)) {
+		printf ("could not check disk %s, it may be mounted or not formatted\n", argv[optind]);
+		exit (8);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	int problems = res.leaked + res.unallocated + res.crosslinked + res.invalid + res.size_mismatch + res.refcounts;
+	printf ("%s: %d files, %ld blocks, checked in %.3f s with %ld threads\n", argv[optind], res.files, (long) res.blocks,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, nthreads);
+	if (res.leaked)
+		printf ("%d blocks allocated but held by no file\n", res.leaked);
+	if (res.unallocated)
+		printf ("%d blocks held by files but free\n", res.unallocated);
+	if (res.crosslinked)
+		printf ("%d files cross-linked\n", res.crosslinked);
+	if (res.invalid)
+		printf ("%d files reaching blocks outside data region\n", res.invalid);
+	if (res.size_mismatch)
+		printf ("%d files with blocks past their size\n", res.size_mismatch);
+	if (res.refcounts)
+		printf ("%d shared blocks with reference count not matching their files\n", res.refcounts);
+	if (problems)
+		printf (repair ? "repaired\n" : "run with -r to repair\n");
+	return !problems ? 0 : repair ? 1 : 4;
+}
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ioqueue.h"
+
+// raw disk access and its counter, implemented in myfs.c
+int getblocks(int blocknum, int count, void **bufs);
+int putblocks(int blocknum, int count, void **bufs);
+void stat_io(int write, int count);
+
+int ioq_backend = IOQ_SYNC;
+int ioq_fd;
+int ioq_blocksize;
+pthread_mutex_t ioq_lock = PTHREAD_MUTEX_INITIALIZER; // one batch at a time goes through the ring or the pool
+
+// io_uring state, rings shared with the kernel
+struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned entries;
+} ring;
+
+// thread pool state
+struct {
+	pthread_t threads[IOQTHREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct ioq_req *reqs; // current batch
+	int n, next;          // size of batch, next request to be taken
+	int pending;          // requests not yet complete
+	int stop;
+} pool;
+
+// asynchronous batches, queued in order of submission and run by a thread of their own
+struct ioq_batch {
+	struct ioq_req *reqs;
+	int n;
+	ioq_done done;
+	void *arg;
+	struct ioq_batch *next;
+};
+
+struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work, idle;
+	struct ioq_batch *head, *tail;
+	int running; // batch taken off queue and not complete yet
+	int started, stop;
+} async;
+
+int uring_init();
+void uring_destroy();
+int uring_submit(struct ioq_req *reqs, int n);
+int pool_init();
+void pool_destroy();
+int pool_submit(struct ioq_req *reqs, int n);
+int async_init();
+void async_destroy();
+
+// executes a single request with positional I/O
+int ioq_exec(struct ioq_req *req)
+{
+	void *bufs[MAXIOV];
+
+	for (int i = 0; i < req->count; ++i)
+		bufs[i] = req->iov[i].iov_base;
+	req->res = req->write ? putblocks(req->blocknum, req->count, bufs)
+	                      : getblocks(req->blocknum, req->count, bufs);
+	return req->res;
+}
+
+int ioq_init(int fd, int blocksize)
+{
+	ioq_fd = fd;
+	ioq_blocksize = blocksize;
+	if (uring_init() == 0)
+		ioq_backend = IOQ_URING;
+	else if (pool_init() == 0)
+		ioq_backend = IOQ_THREADS;
+	else
+		ioq_backend = IOQ_SYNC;
+	if (ioq_backend != IOQ_SYNC)
+		async_init(); // batches are run before returning if thread cannot be started
+	return ioq_backend;
+}
+
+void ioq_destroy()
+{
+	async_destroy();
+	if (ioq_backend == IOQ_URING)
+		uring_destroy();
+	else if (ioq_backend == IOQ_THREADS)
+		pool_destroy();
+	ioq_backend = IOQ_SYNC;
+}
+
+int ioq_submit(struct ioq_req *reqs, int n)
+{
+	int res = 0;
+
+	if (ioq_backend != IOQ_SYNC) {
+		pthread_mutex_lock(&ioq_lock);
+		res = ioq_backend == IOQ_URING ? uring_submit(reqs, n) : pool_submit(reqs, n);
+		pthread_mutex_unlock(&ioq_lock);
+		return res;
+	}
+
+	for (int i = 0; i < n; ++i)
+		if (ioq_exec(&reqs[i]))
+			res = -1;
+	return res;
+}
+
+// io_uring, set up through raw system calls
+
+int uring_init()
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, IOQDEPTH, &p);
+	if (ring.fd < 0)
+		return -1;
+
+	ring.entries = p.sq_entries;
+	ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// both rings may share a single mapping
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_size > ring.sq_size)
+			ring.sq_size = ring.cq_size;
+		ring.cq_size = ring.sq_size;
+	}
+
+	ring.sq_ptr = mmap(0, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                   ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) {
+		close(ring.fd);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ptr = ring.sq_ptr;
+	} else {
+		ring.cq_ptr = mmap(0, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                   ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED) {
+			munmap(ring.sq_ptr, ring.sq_size);
+			close(ring.fd);
+			return -1;
+		}
+	}
+
+	ring.sqes = mmap(0, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		if (ring.cq_ptr != ring.sq_ptr)
+			munmap(ring.cq_ptr, ring.cq_size);
+		munmap(ring.sq_ptr, ring.sq_size);
+		close(ring.fd);
+		return -1;
+	}
+
+	ring.sq_head  = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail  = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask  = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.array);
+	ring.cq_head  = (unsigned *) ((char *) ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail  = (unsigned *) ((char *) ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask  = (unsigned *) ((char *) ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe *) ((char *) ring.cq_ptr + p.cq_off.cqes);
+
+	return 0;
+}
+
+void uring_destroy()
+{
+	munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_size);
+	munmap(ring.sq_ptr, ring.sq_size);
+	close(ring.fd);
+}
+
+int uring_submit(struct ioq_req *reqs, int n)
+{
+	int res = 0;
+
+	// submit at most ring.entries requests at a time, all reaped before the next chunk
+	for (int first = 0; first < n; first += ring.entries) {
+		unsigned len = n - first < ring.entries ? n - first : ring.entries;
+		unsigned tail = *ring.sq_tail, mask = *ring.sq_mask;
+
+		for (unsigned k = 0; k < len; ++k) {
+			struct ioq_req *req = &reqs[first + k];
+			unsigned idx = (tail + k) & mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = ioq_fd;
+			sqe->addr = (unsigned long) req->iov;
+			sqe->len = req->count;
+			sqe->off = (unsigned long long) req->blocknum * ioq_blocksize;
+			sqe->user_data = (unsigned long) req;
+			ring.sq_array[idx] = idx;
+		}
+		__atomic_store_n(ring.sq_tail, tail + len, __ATOMIC_RELEASE);
+
+		// submit and wait for completions until all are reaped
+		unsigned submitted = 0, completed = 0;
+		while (completed < len) {
+			int ret = syscall(__NR_io_uring_enter, ring.fd, len - submitted, 1,
+			                  IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			submitted += ret;
+
+			unsigned head = *ring.cq_head;
+			unsigned ctail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != ctail; ++head, ++completed) {
+				struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+				struct ioq_req *req = (struct ioq_req *) (unsigned long) cqe->user_data;
+
+				// redo short or failed transfers synchronously
+				if (cqe->res == req->count * ioq_blocksize) {
+					req->res = 0;
+					stat_io(req->write, req->count);
+				} else
+					ioq_exec(req);
+				if (req->res)
+					res = -1;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	return res;
+}
+
+// thread pool
+
+void *pool_work(void *arg)
+{
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.stop && pool.next == pool.n)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.stop)
+			break;
+
+		struct ioq_req *req = &pool.reqs[pool.next++];
+		pthread_mutex_unlock(&pool.lock);
+		ioq_exec(req);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+int pool_init()
+{
+	int i;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.reqs = NULL;
+	pool.n = pool.next = pool.pending = pool.stop = 0;
+
+	for (i = 0; i < IOQTHREADS; ++i)
+		if (pthread_create(&pool.threads[i], NULL, pool_work, NULL))
+			break;
+
+	if (i < IOQTHREADS) {
+		// stop threads already started
+		pthread_mutex_lock(&pool.lock);
+		pool.stop = 1;
+		pthread_cond_broadcast(&pool.work);
+		pthread_mutex_unlock(&pool.lock);
+		while (i--)
+			pthread_join(pool.threads[i], NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+void pool_destroy()
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < IOQTHREADS; ++i)
+		pthread_join(pool.threads[i], NULL);
+}
+
+int pool_submit(struct ioq_req *reqs, int n)
+{
+	int res = 0;
+
+	if (n == 0)
+		return 0;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.reqs = reqs;
+	pool.n = n;
+	pool.next = 0;
+	pool.pending = n;
+	pthread_cond_broadcast(&pool.work);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pool.reqs = NULL;
+	pool.n = pool.next = 0;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < n; ++i)
+		if (reqs[i].res)
+			res = -1;
+	return res;
+}
+
+// asynchronous batches
+
+void *async_work(void *arg)
+{
+	pthread_mutex_lock(&async.lock);
+	for (;;) {
+		while (!async.stop && async.head == NULL)
+			pthread_cond_wait(&async.work, &async.lock);
+		if (async.head == NULL)
+			break; // stopping, and every batch is complete
+
+		struct ioq_batch *b = async.head;
+		async.head = b->next;
+		if (async.head == NULL)
+			async.tail = NULL;
+		async.running = 1;
+		pthread_mutex_unlock(&async.lock);
+		b->done(b->reqs, b->n, ioq_submit(b->reqs, b->n), b->arg);
+		free(b);
+		pthread_mutex_lock(&async.lock);
+
+		async.running = 0;
+		if (async.head == NULL)
+			pthread_cond_broadcast(&async.idle);
+	}
+	pthread_mutex_unlock(&async.lock);
+	return NULL;
+}
+
+int async_init()
+{
+	pthread_mutex_init(&async.lock, NULL);
+	pthread_cond_init(&async.work, NULL);
+	pthread_cond_init(&async.idle, NULL);
+	async.head = async.tail = NULL;
+	async.running = async.stop = 0;
+	async.started = pthread_create(&async.thread, NULL, async_work, NULL) == 0;
+	return async.started ? 0 : -1;
+}
+
+void async_destroy()
+{
+	if (!async.started)
+		return;
+
+	pthread_mutex_lock(&async.lock);
+	async.stop = 1;
+	pthread_cond_signal(&async.work);
+	pthread_mutex_unlock(&async.lock);
+	pthread_join(async.thread, NULL);
+	async.started = 0;
+}
+
+void ioq_submitasync(struct ioq_req *reqs, int n, ioq_done done, void *arg)
+{
+	struct ioq_batch *b = async.started ? malloc(sizeof(struct ioq_batch)) : NULL;
+
+	if (b == NULL) {
+		done(reqs, n, ioq_submit(reqs, n), arg);
+		return;
+	}
+
+	b->reqs = reqs;
+	b->n = n;
+	b->done = done;
+	b->arg = arg;
+	b->next = NULL;
+	pthread_mutex_lock(&async.lock);
+	if (async.tail)
+		async.tail->next = b;
+	else
+		async.head = b;
+	async.tail = b;
+	pthread_cond_signal(&async.work);
+	pthread_mutex_unlock(&async.lock);
+}
+
+void ioq_drain()
+{
+	if (!async.started)
+		return;
+
+	pthread_mutex_lock(&async.lock);
+	while (async.head || async.running)
+		pthread_cond_wait(&async.idle, &async.lock);
+	pthread_mutex_unlock(&async.lock);
+}
@@ -0,0 +1,53 @@
+/*
+ * Batched block I/O: a batch of requests is submitted at once and waited on together,
+ * through io_uring if available, else through a pool of threads doing positional I/O;
+ * batches may also be queued to run in the background
+ */
+
+#ifndef __IOQUEUE_H
+#define __IOQUEUE_H
+
+#include <sys/uio.h>
+
+#include "myfs.h"
+
+#define MAXIOV     64 // max blocks moved by a single request
+#define IOQDEPTH   64 // max requests in flight
+#define IOQTHREADS 4  // threads used if io_uring is not available
+
+// backends
+#define IOQ_SYNC    0 // requests executed one by one by the caller
+#define IOQ_URING   1
+#define IOQ_THREADS 2
+
+struct ioq_req {
+	int blocknum; // first block
+	int count;    // number of consecutive blocks, at most MAXIOV
+	int write;    // 0 for read, 1 for write
+	int res;      // set on completion, 0 if successful, -1 otherwise
+	struct iovec iov[MAXIOV]; // one buffer of a block for each block
+};
+
+// starts a backend for disk file fd of blocks of blocksize bytes, io_uring if available, else threads
+// returns backend used
+int ioq_init(int fd, int blocksize);
+
+// waits for asynchronous batches and stops backend, subsequent batches are executed synchronously
+void ioq_destroy();
+
+// submits all n requests and waits until all are complete
+// returns -1 if any request failed, may be called from several threads at once
+int ioq_submit(struct ioq_req *reqs, int n);
+
+// called once every request of an asynchronous batch is complete, with res as ioq_submit would return
+typedef void (*ioq_done)(struct ioq_req *reqs, int n, int res, void *arg);
+
+// submits all n requests without waiting, batches are run in order by a thread of the queue
+// and done is called from that thread; with no backend started, the batch is run before returning
+// reqs must stay valid until done is called
+void ioq_submitasync(struct ioq_req *reqs, int n, ioq_done done, void *arg);
+
+// waits until every asynchronous batch is complete
+void ioq_drain();
+
+#endif
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+void mutex_init(pthread_mutex_t *mutex, int shared)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	if (shared) {
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void rwlock_init(struct rwlock *lock, int shared)
+{
+	memset(lock, 0, sizeof(*lock));
+	mutex_init(&lock->lock, shared);
+	cond_init(&lock->changed, shared);
+}
+
+void rwlock_init_wrpref(struct rwlock *lock, int shared)
+{
+	rwlock_init(lock, shared);
+	lock->wrpref = 1;
+}
+
+void cond_init(pthread_cond_t *cond, int shared)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	if (shared)
+		pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+// state guarded by mutex may be half updated, but it is still better than waiting forever
+void mutex_lock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(mutex);
+}
+
+void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	if (pthread_cond_wait(cond, mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(mutex);
+}
+
+// Reader/writer locks
+
+// returns slot of process pid, taking a free one if it has none, NULL if none is free
+struct rwslot *rwlock_slot(struct rwlock *lock, int pid)
+{
+	struct rwslot *free = NULL;
+
+	for (int i = 0; i < RWSLOTS; ++i) {
+		if (lock->slots[i].pid == pid)
+			return &lock->slots[i];
+		if (!lock->slots[i].pid && !free)
+			free = &lock->slots[i];
+	}
+	if (free)
+		free->pid = pid;
+	return free;
+}
+
+// frees slot once its process neither holds nor waits for the lock
+void rwlock_release(struct rwslot *slot)
+{
+	if (slot->readers == 0 && slot->waiting == 0)
+		slot->pid = 0;
+}
+
+// drops what processes that died held or waited for
+void rwlock_reap(struct rwlock *lock)
+{
+	if (lock->writer && kill(lock->writer, 0) == -1 && errno == ESRCH)
+		lock->writer = 0;
+	for (int i = 0; i < RWSLOTS; ++i) {
+		struct rwslot *slot = &lock->slots[i];
+		if (slot->pid && kill(slot->pid, 0) == -1 && errno == ESRCH) {
+			lock->readers -= slot->readers;
+			lock->waiting -= slot->waiting;
+			memset(slot, 0, sizeof(*slot));
+		}
+	}
+	pthread_cond_broadcast(&lock->changed);
+}
+
+// waits for lock to change, looking for holders that died every RWREAPMS ms, holding its mutex
+void rwlock_wait(struct rwlock *lock)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_nsec += RWREAPMS * 1000000L;
+	t.tv_sec += t.tv_nsec / 1000000000L;
+	t.tv_nsec %= 1000000000L;
+
+	int res = pthread_cond_timedwait(&lock->changed, &lock->lock, &t);
+	if (res == EOWNERDEAD)
+		pthread_mutex_consistent(&lock->lock);
+	else if (res == ETIMEDOUT)
+		rwlock_reap(lock);
+}
+
+void rwlock_rdlock(struct rwlock *lock)
+{
+	struct rwslot *slot;
+	int pid = getpid();
+
+	mutex_lock(&lock->lock);
+	while (lock->writer || (lock->wrpref && lock->waiting) || (slot = rwlock_slot(lock, pid)) == NULL)
+		rwlock_wait(lock);
+	slot->readers++;
+	lock->readers++;
+	pthread_mutex_unlock(&lock->lock);
+}
+
+void rwlock_wrlock(struct rwlock *lock)
+{
+	struct rwslot *slot;
+	int pid = getpid();
+
+	mutex_lock(&lock->lock);
+	while ((slot = rwlock_slot(lock, pid)) == NULL)
+		rwlock_wait(lock);
+	slot->waiting++;
+	lock->waiting++;
+	while (lock->writer || lock->readers)
+		rwlock_wait(lock);
+	slot->waiting--;
+	lock->waiting--;
+	rwlock_release(slot);
+	lock->writer = pid;
+	pthread_mutex_unlock(&lock->lock);
+}
+
+// a lock held for writing is held by the caller, as no one may read it meanwhile
+void rwlock_unlock(struct rwlock *lock)
+{
+	mutex_lock(&lock->lock);
+	if (lock->writer) {
+		lock->writer = 0;
+	} else {
+		struct rwslot *slot = rwlock_slot(lock, getpid());
+		if (slot && slot->readers) {
+			slot->readers--;
+			lock->readers--;
+		}
+		if (slot)
+			rwlock_release(slot);
+	}
+	pthread_cond_broadcast(&lock->changed);
+	pthread_mutex_unlock(&lock->lock);
+}
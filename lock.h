@@ -0,0 +1,46 @@
+/*
+ * Locks that may be placed in memory shared between processes
+ */
+
+#ifndef __LOCK_H
+#define __LOCK_H
+
+#include <pthread.h>
+
+#define RWSLOTS  16  // most processes holding or waiting for a reader/writer lock at once
+#define RWREAPMS 100 // waiters look for holders that died this often
+
+// reader/writer lock built on a robust mutex, holders are recorded by process
+// so that those left by processes that died are dropped by the threads waiting for them
+struct rwlock {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int writer;    // process holding it for writing, 0 if none
+	int readers;   // read locks held
+	int waiting;   // writers waiting
+	char wrpref;   // waiting writers hold off new readers
+	struct rwslot {
+		int pid;     // 0 if slot is free
+		int readers; // read locks held by process
+		int waiting; // writers of process waiting
+	} slots[RWSLOTS];
+};
+
+// if shared, lock may be used by every process mapping it
+// shared mutexes are robust: if their owner dies, the next process to lock them takes them over
+void mutex_init(pthread_mutex_t *, int shared);
+void rwlock_init(struct rwlock *, int shared);
+// waiting writers hold off new readers, so no thread may read lock it while already holding it
+void rwlock_init_wrpref(struct rwlock *, int shared);
+void cond_init(pthread_cond_t *, int shared);
+
+// lock mutex, or wait on condition, taking the mutex over if its owner died
+void mutex_lock(pthread_mutex_t *);
+void cond_wait(pthread_cond_t *, pthread_mutex_t *);
+
+// reader/writer locks never fail, a lock held by a process that died is taken once it is noticed
+void rwlock_rdlock(struct rwlock *);
+void rwlock_wrlock(struct rwlock *);
+void rwlock_unlock(struct rwlock *);
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // copy_file_range, splice, sync_file_range
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,28 +9,34 @@
 #include <fcntl.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
-// #include <sys/mman.h> // uncomment this and compile with -lrt for concurrency
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
 
 #include "myfs.h"
 
 // Global Variables
 char disk_name[128];   // name of virtual disk file
-int  disk_size;        // size in bytes - a power of 2
+int64_t disk_size;     // size in bytes
 int  disk_fd = 0;      // disk file handle
 int  disk_blockcount;  // block count on disk
+int  disk_blocksize;   // bytes per block, power of 2 between MINBLOCKSIZE and MAXBLOCKSIZE
+int  disk_maxfiles;    // number of FCBs
+char *disk_map = NULL; // whole disk mapped into memory, if mounted with MYFS_MMAP
+char *map_dirty;       // blocks of mapping modified since mount, synced at umount
 
 /*
  * File System Implementation:
  * - Superblock contains above global variables, apart from disk_fd, also links to FAT, free blocks, etc.
- * - Directory structure implemented as sorted dynamic array of maximum size 128
- *   32K total blocks in disk, give 15 bits; represent block number by 16 bits
- *   128 * (32 + 2) < 2 blocks for directory entry
+ * - Geometry (disk size, block size, number of files) is chosen at format and recorded in the superblock
+ *   Block numbers are 32 bits, file sizes and offsets 64 bits
+ * - Directory structure implemented as hash-indexed array of maximum size maxfiles, in the blocks after the superblock
  * - FCBs contain file size (hence number of blocks) and list of blocks used, may reference FAT
  *   Kept in separate table for easy reference by FAT and open file table
- *   Each reference contains 6 bytes for FCB and 1 byte for valid/invalid, FCB table plus directory table have
- *   128 * (32 + 2 + 7) + 4 < 2 blocks
- * - FAT may also record allocated metadata blocks, in order to find free space to allocate FCBs etc.
- *   Otherwise, FAT only needs to record 3/4 of 32K block numbers, reducing its size to 12 blocks
+ * - FAT has an entry for every block of the disk, metadata blocks are never allocated
+ *   128 MB disk of 4K blocks: 2 blocks for directory, 32 for FAT
  *
  * In memory:
  * - Cached copies of superblock, directory entries, FCBs (as necessary; allocated on heap), FAT
@@ -50,50 +58,312 @@ int  disk_blockcount;  // block count on disk
 
 #include "dir.h"
 #include "opentable.h"
+#include "cache.h"
+#include "blockmap.h"
+#include "extent.h"
+#include "bitmap.h"
+#include "lock.h"
+
+#define MYFS_MAGIC 0x3453594d // "MYS4", disks formatted before sparse files are not mounted
 
-// directory entry, inode table, FAT etc. locations hardcoded, need not be kept here
+// geometry and location of each region, regions follow each other in this order
 struct superblock {
 	char disk_name[128];
-	int disk_size;
+	int64_t disk_size;
 	int disk_blockcount;
-	// TODO need not be kept
-} superblock;
+	int flags; // format options, e.g. MYFS_EXTENTS
+	uint32_t magic;
+	int blocksize;
+	int maxfiles;
+	BLOCKTYPE dirstart; // directory
+	BLOCKTYPE fatstart; // FAT
+	BLOCKTYPE refstart; // reference counts of blocks, part of FAT region
+	BLOCKTYPE gapstart; // holes before blocks of chains, part of FAT region
+	BLOCKTYPE extstart; // extent table
+	BLOCKTYPE logstart; // metadata log
+	BLOCKTYPE datastart; // data blocks, up to disk_blockcount
+	BLOCKTYPE fatinit; // FAT blocks written since format, later ones are all free whatever their contents
+	uint64_t logseq; // sequence number of first batch in log, batches with other numbers are stale
+} *superblock;
+
+int sb_layout(struct superblock *sb);
+
+// state of mounted disk used by every thread, and by every process mounting the disk with MYFS_SHARED
+// kept in a single segment, a shared memory object in that case, which every process maps at the same address
+// so that the segment may hold pointers into itself; the rest is local to each process
+struct shared {
+	void *addr;  // where segment is mapped
+	size_t size;
+	int opts;    // mount options of process that set up segment
+	struct superblock superblock;
+	struct cache cache; // unused if disk is mapped
+	struct bitmap freemap;
+	BLOCKTYPE newfile_hint; // where search for first block of next new file starts
+	int64_t saved_blocks;   // sum of reference counts, blocks clones would take if they were copies
+	int orphans;            // files deleted with MYFS_LAZYFREE whose blocks are not yet freed
+	struct rwlock op_lock;
+	struct rwlock dir_lock;
+	pthread_mutex_t open_lock;
+	pthread_mutex_t alloc_lock;
+	pthread_mutex_t log_lock;
+	uint64_t log_seq; // sequence number of next batch
+	int log_tail;     // block of log next batch is written at
+	int log_pending;  // metadata may have changed since last commit
+	char *log_buf;    // LOGSIZE blocks, batch being written or replayed
+	char *dirbuf;
+	BLOCKTYPE *fat;
+	char *fat_dirty;  // FAT blocks changed since last commit
+	char *fat_freed;  // FAT blocks with entries of blocks freed since last commit, see fat_dealloc
+	char *ext_dirty;  // files whose extent lists changed since last commit
+	int *opencounts;
+	uint32_t *file_gens;
+	struct rwlock *inode_locks;
+	struct extlist *extlists;
+	struct extent *extents; // room for MAXEXTENTS extents of every file, if disk is formatted with MYFS_EXTENTS
+
+	// metadata as of last commit, written in place at checkpoint, and what of it was logged since
+	char *dir_shadow;
+	char *dir_logged; // per directory block
+	BLOCKTYPE *fat_shadow;
+	char *fat_logged;
+	struct extlist *ext_shadow;
+	struct extent *shadow_extents;
+	char *ext_logged;
+
+	// counters of myfs_stats, updated atomically, those of the cache and allocation are kept by the cache and freemap
+	struct myfs_stats stats;
+} *shared;
+
+char shm_name[64]; // named after device and inode number of disk file
+int mount_opts;
+
+// adds n to counter of myfs_stats, blocks are also read and written before the segment is set up
+#define STAT_ADD(field, n) do {							\
+	if (shared)								\
+		__atomic_fetch_add(&shared->stats.field, (n), __ATOMIC_RELAXED);	\
+} while (0)
+int open_max; // most entries of open file table in use at once since mount or reset
+
+size_t seg_layout(char *base, struct superblock *sb, int opts);
+int seg_create(struct superblock *sb, int opts);
+int seg_attach(int opts);
+void seg_use();
+int seg_load();
+int sb_store();
+int dir_store();
+void seg_free(int last);
+int disk_lock(int byte, int type, int wait);
+
+struct dir *dir;             // attached to directory in segment, or in disk mapping
+struct opentable *opentable; // local to process
+
+// locks in segment, always taken in this order: open entry, operation, directory, inode, open file table, allocation
+// block cache and log take their own locks; mount and umount must not run alongside other calls of the same process
+// mutexes and reader/writer locks survive processes dying while holding them
+struct rwlock *op_lock;        // read locked by calls changing metadata, write locked to take a consistent copy of it
+struct rwlock *dir_lock;       // directory entries
+pthread_mutex_t *open_lock;    // open file table, open counts, building and freeing block maps
+struct rwlock *inode_locks;    // one for each fcb: inode, block map, extent list and write buffers of file
+pthread_mutex_t *alloc_lock;   // FAT and free block bitmap
+
+struct open_entry *entry_lock(int fd);
+int inode_rdlock(int inum);
+int inode_wrlock(int inum);
+
+// number of open entries of each file in every process, files open anywhere may not be deleted
+int *opencounts;
+
+int file_read(struct open_entry *entry, void *buf, int n);
+int entry_write(struct open_entry *entry, void *buf, int n);
+int file_write(struct open_entry *entry, void *buf, int n);
+BLOCKTYPE getwriteblock(struct open_entry *entry, int i, int whole);
+BLOCKTYPE file_unshare(struct open_entry *entry, int i, int whole);
+BLOCKTYPE file_fillhole(struct open_entry *entry, int i);
+int file_extset(struct open_entry *entry, int i, BLOCKTYPE blk);
+BLOCKTYPE getnewblock(struct open_entry *entry, struct blockmap *map, int gap);
+int file_zerotail(struct open_entry *entry);
+int file_truncate(struct open_entry *entry, int64_t size);
+int file_free(int inum);
+void file_reclaim();
+int file_sync(int inum);
+
+// copying between files and host descriptors in runs of consecutive blocks, without reading them into user space
+#define COPYRUN 1024 // most blocks copied at once
+
+int64_t host_copy(int in_fd, off_t *off_in, int out_fd, off_t *off_out, int64_t len);
+int64_t host_splice(int in_fd, off_t *off_in, int out_fd, off_t *off_out, int64_t len);
+int64_t file_import(struct open_entry *entry, int in_fd, off_t *off, int64_t len);
+int64_t file_run(struct open_entry *entry, off_t *pos);
+
+// block maps of open files, built on first open and freed on last close in process, one for each fcb
+// a block map is rebuilt once the generation of its file moves past the one it was built at,
+// which happens whenever another process changes the blocks of the file
+struct blockmap *bmaps;
+uint32_t *file_gens; // in segment
+uint32_t *bmap_gens; // local
+
+// a block map has an entry for every block of its file up to the last one, holes included,
+// so files may only reach as many blocks as the disk has, or 16M blocks on smaller disks
+#define MAXFILEBLOCKS ((int64_t) disk_blockcount > (1 << 24) ? (int64_t) disk_blockcount : (1 << 24))
+
+int bmap_build(int inum, struct blockmap *map);
+int bmap_refresh(int inum);
+void open_fixup(int inum);
+
+// readahead window of sequential reads starts at RAMIN blocks and doubles up to RAMAX
+#define RAMIN 4
+#define RAMAX 64
+
+void file_readahead(struct open_entry *entry, int64_t start, int64_t end);
+
+// write buffers of open entries, flushed into the cache
+int *wb_pending; // number of entries of each file holding a buffered block
+int wb_flush(struct open_entry *entry);
+int wb_flushfile(int inum, struct open_entry *except); // flushes every other entry of inum
+
+// extent lists of every file, if disk is formatted with MYFS_EXTENTS
+// blocks of such files are marked allocated in the FAT, but not linked
+struct extlist *extlists;
+
+char *ext_dirty; // files whose extent lists changed since last commit, set holding allocation lock
+
+int ext_load();
+int ext_store();
+
+// metadata log: changes to directory, FAT and extent lists are committed as batches of records
+// appended to the log with a single fdatasync, every LOGINTERVAL ms by a thread of each process
+// once the log is full, committed metadata is written in place and the log starts over (checkpoint)
+// blocks written before a commit, buffered in the cache or the disk mapping, reach disk along with it
+#define LOGINTERVAL 100
+
+struct log_batch {
+	uint32_t magic;
+	uint32_t nblocks; // blocks of log taken by batch
+	uint64_t seq;
+	uint32_t len;     // bytes of records following header
+	uint32_t sum;     // checksum of records
+};
+
+// records are padded to 8 bytes
+struct log_record {
+	uint32_t type;  // one of the below
+	uint32_t len;   // bytes of data following record
+	uint64_t where; // byte offset in directory, FAT block or inum
+};
+
+#define LOG_MAGIC 0x474f4c4d // "MLOG"
+#define LOG_DIR   1 // bytes of directory
+#define LOG_FAT   2 // whole FAT block
+#define LOG_EXT   3 // overflow block, number of extents and extents of file
+
+int log_commit(int sync, int all);
+int log_checkpoint();
+int log_replay();
+void log_snapshot(int mark);
+int log_start();
+void log_stop();
+void log_reclaim();
+int log_freespace();
+void op_begin();
+void op_end();
+int log_starting = 1; // mount starts log thread, except for checks that repair nothing
+
+// block cache, all blocks are read and written through it after mount
+struct cache *cache;
+int cache_frames = CACHEFRAMES;
 
-// shared memory
-// using shm requires linking to another static library
-int shm_fd;
-size_t shm_size = 2*BLOCKSIZE + sizeof(struct opentable); // 2 blocks for dir, to make it align better
-char shm_name[133]; // myfs_diskname
-
-// make these point to shared memory
-struct dir *dir;
-struct opentable *opentable;
+// FAT functions
 
+// 4 bytes per FAT entry, FAT follows directory
+#define FATPERBLOCK    (disk_blocksize / sizeof(BLOCKTYPE))
+#define FATBLOCK(blk)  (superblock->fatstart + (blk) / FATPERBLOCK)
+#define FATOFFSET(blk) ((blk) % FATPERBLOCK)
+
+// size of FAT in blocks, reference counts and gaps included
+#define FATSIZE (superblock->extstart - superblock->fatstart)
+
+// 2 bytes per reference count, counts follow FAT entries and are loaded, logged and written along with them
+// a count is the number of files holding the block besides the first, 0 for free and unshared blocks
+#define REFPERBLOCK   (disk_blocksize / sizeof(uint16_t))
+#define REFBLOCK(blk) (superblock->refstart + (blk) / REFPERBLOCK)
+#define MAXREFS       0xffff
+
+// 4 bytes per gap, gaps follow reference counts and are handled along with FAT entries as well
+// a gap is the number of blocks of a sparse file holding no data right before the block in its chain
+// so that a chain records holes without blocks for them; blocks of extent lists record holes as extents
+#define GAPPERBLOCK   (disk_blocksize / sizeof(uint32_t))
+#define GAPBLOCK(blk) (superblock->gapstart + (blk) / GAPPERBLOCK)
+
+// extent table follows FAT, one entry for each fcb
+#define EXTBLOCK (superblock->extstart)
+#define EXTSIZE  (superblock->logstart - superblock->extstart)
+
+// metadata log follows extent table
+#define LOGBLOCK (superblock->logstart)
+#define LOGSIZE  (superblock->datastart - superblock->logstart)
+#define LOGMINBLOCKS 16
+#define LOGMAXBLOCKS 4096
+
+// first data block
+#define DATASTART (superblock->datastart)
+
+// in-memory copy of the FAT, loaded at mount, changes to it are logged and written in place at checkpoint
+// FAT blocks are marked dirty on modification, until they are next committed
+BLOCKTYPE *fat;
+char *fat_dirty;
+char *fat_freed;
+uint16_t *refs; // in FAT region of segment
+uint32_t *gaps; // same
+
+// free block bitmap built from FAT at mount, metadata blocks are always marked allocated
+struct bitmap *freemap;
+
+// new runs of blocks of a file are started where at least this many blocks are free, if possible
+#define ALLOCRUN 8
+
+int fat_load();
+int fat_buildmap();
+int fat_sync();
 BLOCKTYPE fat_getnext(BLOCKTYPE blk);
+BLOCKTYPE fat_alloc(BLOCKTYPE hint); // allocates a free block, trying the one after hint first (0 for new file), returns 0 if none available
 BLOCKTYPE fat_setnext(BLOCKTYPE blk); // finds and sets next block for blk (0 represents new file), if none available returns 0
-int fat_dealloc(BLOCKTYPE blk); // deallocates block
+int fat_dealloc(BLOCKTYPE blk); // deallocates block, left allocated in freemap until committed
+int fat_setend(BLOCKTYPE blk); // marks blk as last block of its chain
+int fat_link(BLOCKTYPE blk, BLOCKTYPE next); // makes next follow blk in its chain
+int fat_share(BLOCKTYPE blk); // adds a file holding blk, returns -1 if it has too many
+int fat_release(BLOCKTYPE blk); // drops a file holding blk, deallocating it once none does
+int fat_releaseblocks(BLOCKTYPE *blks, int n); // same for n blocks, 0 for holes, freeing runs a FAT block at a time
+int fat_setgap(BLOCKTYPE blk, uint32_t gap); // records gap blocks of holes before blk in its chain
+void fat_releasefreed(); // returns blocks freed as of last commit to freemap
+
+// block access for mounted disk, through the disk mapping if there is one, else through the cache
+char *mapblock(int blk);
+int readblocks(int *blks, int count, void *buf);
+char *loadblock(int blk, char *buf);
+int writeblock(int blk, void *buf);
+int writeblocks(int *blks, int count, void *buf);
+int prefetchblocks(int *blks, int count);
+int copyblocks(int *from, int *to, int count);
+int map_sync();
+void stat_io(int write, int count);
+int disk_sync();
+int disk_startsync(int *blks, int count);
 
 /*
    Reads block blocknum into buffer buf.
-   You will not modify the getblock() function.
+   Uses positional I/O, so that the file offset of disk_fd is never changed.
    Returns -1 if error. Should not happen.
 */
 int getblock (int blocknum, void *buf)
 {
-	int offset, n;
+	ssize_t n;
 
-	if (blocknum >= disk_blockcount)
+	if (blocknum < 0 || blocknum >= disk_blockcount)
 		return (-1); //error
 
-	offset = lseek (disk_fd, blocknum * BLOCKSIZE, SEEK_SET);
-	if (offset == -1) {
-		printf ("lseek error\n");
-		exit(0);
-
-	}
-
-	n = read (disk_fd, buf, BLOCKSIZE);
-	if (n != BLOCKSIZE)
+	n = pread (disk_fd, buf, disk_blocksize, (off_t) blocknum * disk_blocksize);
+	stat_io(0, 1);
+	if (n != disk_blocksize)
 		return (-1);
 
 	return (0);
@@ -102,75 +372,218 @@ int getblock (int blocknum, void *buf)
 
 /*
     Puts buffer buf into block blocknum.
-    You will not modify the putblock() function
     Returns -1 if error. Should not happen.
 */
 int putblock (int blocknum, void *buf)
 {
-	int offset, n;
+	ssize_t n;
 
-	if (blocknum >= disk_blockcount)
+	if (blocknum < 0 || blocknum >= disk_blockcount)
 		return (-1); //error
 
-	offset = lseek (disk_fd, blocknum * BLOCKSIZE, SEEK_SET);
-	if (offset == -1) {
-		printf ("lseek error\n");
-		exit (1);
+	n = pwrite (disk_fd, buf, disk_blocksize, (off_t) blocknum * disk_blocksize);
+	stat_io(1, 1);
+	if (n != disk_blocksize)
+		return (-1);
+
+	return (0);
+}
+
+
+/*
+   Reads count consecutive blocks starting from blocknum, block i into bufs[i].
+   Issues one preadv for every MAXIOV blocks.
+   Returns -1 if error.
+*/
+int getblocks (int blocknum, int count, void **bufs)
+{
+	struct iovec iov[MAXIOV];
+	int i, k;
+	ssize_t n;
+
+	if (blocknum < 0 || count < 0 || blocknum + count > disk_blockcount)
+		return (-1);
+
+	for (i = 0; i < count; i += k) {
+		for (k = 0; k < MAXIOV && i + k < count; ++k) {
+			iov[k].iov_base = bufs[i + k];
+			iov[k].iov_len = disk_blocksize;
+		}
+		n = preadv (disk_fd, iov, k, (off_t) (blocknum + i) * disk_blocksize);
+		stat_io(0, k);
+		if (n != (ssize_t) k * disk_blocksize)
+			return (-1);
 	}
 
-	n = write (disk_fd, buf, BLOCKSIZE);
-	if (n != BLOCKSIZE)
+	return (0);
+}
+
+
+/*
+   Writes bufs[i] into block blocknum + i for each of count blocks.
+   Issues one pwritev for every MAXIOV blocks.
+   Returns -1 if error.
+*/
+int putblocks (int blocknum, int count, void **bufs)
+{
+	struct iovec iov[MAXIOV];
+	int i, k;
+	ssize_t n;
+
+	if (blocknum < 0 || count < 0 || blocknum + count > disk_blockcount)
 		return (-1);
 
+	for (i = 0; i < count; i += k) {
+		for (k = 0; k < MAXIOV && i + k < count; ++k) {
+			iov[k].iov_base = bufs[i + k];
+			iov[k].iov_len = disk_blocksize;
+		}
+		n = pwritev (disk_fd, iov, k, (off_t) (blocknum + i) * disk_blocksize);
+		stat_io(1, k);
+		if (n != (ssize_t) k * disk_blocksize)
+			return (-1);
+	}
+
 	return (0);
 }
 
 
+// counts a read or write of count blocks of disk file, also called by the I/O queue
+void stat_io(int write, int count)
+{
+	if (write) {
+		STAT_ADD(writes, 1);
+		STAT_ADD(write_bytes, (uint64_t) count * disk_blocksize);
+	} else {
+		STAT_ADD(reads, 1);
+		STAT_ADD(read_bytes, (uint64_t) count * disk_blocksize);
+	}
+}
+
+// makes everything written to disk file so far durable
+int disk_sync()
+{
+	STAT_ADD(syncs, 1);
+	return fdatasync(disk_fd);
+}
+
+// starts kernel writeback of blks[0..count-1], one range per run of consecutive blocks, without waiting for it
+// blocks 0 (holes) are skipped; the next disk_sync waits for them, along with anything else dirty in the disk file
+int disk_startsync(int *blks, int count)
+{
+	for (int i = 0, j; i < count; i = j) {
+		for (j = i + 1; j < count && blks[j] == blks[j - 1] + 1; ++j)
+			;
+		if (blks[i] && sync_file_range(disk_fd, (off_t) blks[i] * disk_blocksize, (off_t) (j - i) * disk_blocksize,
+		                               SYNC_FILE_RANGE_WRITE))
+			return -1;
+	}
+	return 0;
+}
+
+
 /*
    IMPLEMENT THE FUNCTIONS BELOW - You can implement additional
    internal functions.
  */
 
-int myfs_diskcreate (char *vdisk)
+// writes zeros to count blocks starting from blocknum, MAXIOV blocks per I/O
+int zeroblocks(int blocknum, int count)
 {
-	int i;
-	char buf[BLOCKSIZE];
+	char *zero = calloc(1, disk_blocksize);
+	void *bufs[MAXIOV];
+	int i, k, res = 0;
 
-	// create new file with size DISKSIZE
-	if (open(vdisk, O_RDWR | O_CREAT, 0666) == -1) {
-		// printf("disk create error %s\n", vdisk);
-		exit(1);
-	}
+	for (k = 0; k < MAXIOV; ++k)
+		bufs[k] = zero;
 
-	// fill disk with zeros (not actually necessary for formatting)
-	bzero(buf, BLOCKSIZE);
+	for (i = 0; i < count && !res; i += MAXIOV) {
+		k = count - i < MAXIOV ? count - i : MAXIOV;
+		res = putblocks(blocknum + i, k, bufs);
+	}
 
-	// set for putblock
-	disk_fd = open(vdisk, O_RDWR);
-	disk_size = DISKSIZE;
-	disk_blockcount = disk_size / BLOCKSIZE;
+	free(zero);
+	return res;
+}
 
-	for (i = 0; i < disk_blockcount; ++i) {
-		if (putblock(i, buf)) {
-			close(disk_fd);
-			disk_fd = 0;
-			return -1;
-		}
+int myfs_diskcreate (char *vdisk)
+{
+	// create new file with size DISKSIZE, a sparse file of zeros whose blocks take up space once written
+	int fd = open(vdisk, O_RDWR | O_CREAT, 0666);
+	if (fd == -1) {
+		// printf("disk create error %s\n", vdisk);
+		return -1;
 	}
 
-	close(disk_fd);
-	disk_fd = 0;
-
-	return 0;
+	int res = (ftruncate(fd, 0) || ftruncate(fd, DISKSIZE)) ? -1 : 0;
+	close(fd);
+	return res;
 }
 
 
 /* format disk of size dsize */
 int myfs_makefs(char *vdisk)
 {
+	return myfs_makefsopt(vdisk, 0);
+}
+
+int myfs_makefsopt(char *vdisk, int opts)
+{
+	return myfs_makefsgeom(vdisk, DISKSIZE, BLOCKSIZE, MAXFILECOUNT, opts);
+}
+
+// most files a disk may be formatted for, as many as a directory of MAXDIRSIZE bytes holds
+#define MAXFILES dir_maxfiles(MAXDIRSIZE)
+
+// fills in location of every region from geometry, returns -1 if geometry is not supported
+int sb_layout(struct superblock *sb)
+{
+	int64_t blockcount = sb->disk_size / sb->blocksize;
+
+	if (sb->blocksize < MINBLOCKSIZE || sb->blocksize > MAXBLOCKSIZE || (sb->blocksize & (sb->blocksize - 1)))
+		return -1;
+	if (sb->maxfiles <= 0 || sb->maxfiles > MAXFILES || blockcount >= INT32_MAX)
+		return -1;
+
+	sb->disk_blockcount = blockcount;
+	sb->dirstart = 1;
+	sb->fatstart = sb->dirstart + (dir_size(sb->maxfiles) + sb->blocksize - 1) / sb->blocksize;
+	sb->refstart = sb->fatstart + (blockcount * sizeof(BLOCKTYPE) + sb->blocksize - 1) / sb->blocksize;
+	sb->gapstart = sb->refstart + (blockcount * sizeof(uint16_t) + sb->blocksize - 1) / sb->blocksize;
+	sb->extstart = sb->gapstart + (blockcount * sizeof(uint32_t) + sb->blocksize - 1) / sb->blocksize;
+	sb->logstart = sb->extstart + (sb->maxfiles * sizeof(struct extent_entry) + sb->blocksize - 1) / sb->blocksize;
+
+	// log takes 1/256 of disk, within bounds
+	int64_t logsize = blockcount / 256;
+	logsize = logsize < LOGMINBLOCKS ? LOGMINBLOCKS : logsize > LOGMAXBLOCKS ? LOGMAXBLOCKS : logsize;
+	sb->datastart = sb->logstart + logsize;
+
+	// need room for at least one block of data
+	return sb->datastart < blockcount ? 0 : -1;
+}
+
+int myfs_makefsgeom(char *vdisk, int64_t disksize, int blocksize, int maxfiles, int opts)
+{
+	struct stat finfo;
+	struct superblock sb;
+
+	// check geometry first
+	if (maxfiles <= 0 || maxfiles > MAXFILES)
+		return -1;
+	memset(&sb, 0, sizeof(struct superblock));
+	strcpy(sb.disk_name, vdisk);
+	sb.disk_size = disksize;
+	sb.flags = opts;
+	sb.magic = MYFS_MAGIC;
+	sb.blocksize = blocksize;
+	sb.maxfiles = maxfiles;
+	if (disk_fd != 0 || sb_layout(&sb))
+		return -1;
+
 	strcpy (disk_name, vdisk);
-	disk_size = DISKSIZE;
-	disk_blockcount = disk_size / BLOCKSIZE;
+	disk_size = disksize;
+	disk_blocksize = blocksize;
+	disk_blockcount = sb.disk_blockcount;
 
 	disk_fd = open (disk_name, O_RDWR);
 	if (disk_fd == -1) {
@@ -179,29 +592,35 @@ int myfs_makefs(char *vdisk)
 	}
 
 	// perform your format operations here.
-	// printf ("formatting disk=%s, size=%d\n", vdisk, disk_size);
+	// printf ("formatting disk=%s, size=%ld\n", vdisk, (long) disk_size);
 
-	char buf[BLOCKSIZE];
-	int i;
-	memset(buf, 0, BLOCKSIZE);
+	// grow disk file to size, new part reads as zeros
+	int res = fstat(disk_fd, &finfo);
+	if (!res && finfo.st_size < disk_size)
+		res = ftruncate(disk_fd, disk_size);
 
-	for (i = 0; i < disk_blockcount / 4; ++i)
-		if (putblock(i, buf))
-			break;
+	// zero directory only, FAT is initialized lazily after the watermark in superblock
+	// and extent table entries are only read for valid files
+	if (!res)
+		res = zeroblocks(sb.dirstart, sb.fatstart - sb.dirstart);
+
+	// log starts empty, with sequence numbers no earlier format of disk is likely to have used
+	sb.logseq = (uint64_t) time(NULL) << 24;
+	if (!res)
+		res = zeroblocks(sb.logstart, 1);
 
 	// write superblock
-	strcpy(superblock.disk_name, disk_name);
-	superblock.disk_size = disk_size;
-	superblock.disk_blockcount = disk_blockcount;
-	memcpy(&superblock, buf, sizeof(struct superblock)); // assuming sizeof superblock < BLOCKSIZE
-	if (putblock(0, buf))
-		return -1;
+	char *buf = calloc(1, disk_blocksize);
+	memcpy(buf, &sb, sizeof(struct superblock)); // assuming sizeof superblock < disk_blocksize
+	if (!res)
+		res = putblock(0, buf);
+	free(buf);
 
 	fsync (disk_fd);
 	close (disk_fd);
 	disk_fd = 0;
 
-	return -(i < disk_blockcount / 4);
+	return res;
 }
 
 /*
@@ -214,6 +633,11 @@ int myfs_makefs(char *vdisk)
 */
 
 int myfs_mount (char *vdisk)
+{
+	return myfs_mountopt(vdisk, 0);
+}
+
+int myfs_mountopt (char *vdisk, int opts)
 {
 	struct stat finfo;
 
@@ -230,75 +654,80 @@ int myfs_mount (char *vdisk)
 
 	fstat (disk_fd, &finfo);
 
-	// printf ("myfs_mount: mounting %s, size=%d\n", disk_name,
-	// 	(int) finfo.st_size);
-	disk_size = (int) finfo.st_size;
-	disk_blockcount = disk_size / BLOCKSIZE;
-
-	// perform your mount operations here
-
-	// allocate temporary buffer the size of 1 block, for better copying
-	char *buf = malloc(BLOCKSIZE);
-
-	// read superblock into buffer
-	if (getblock(0, buf)) {
-		// printf("could not read superblock\n");
-		free(buf);
+	// read superblock before anything else, its geometry is needed to read the rest
+	// superblock is at the start of block 0, whatever the block size
+	struct superblock sb;
+	if (pread(disk_fd, &sb, sizeof(struct superblock), 0) != sizeof(struct superblock) ||
+	    sb.magic != MYFS_MAGIC || sb.disk_size > finfo.st_size || sb_layout(&sb)) {
+		// printf("myfs_mount: %s is not formatted\n", disk_name);
+		close(disk_fd);
+		disk_fd = 0;
 		return -1;
 	}
-	memcpy(&superblock, buf, sizeof(struct superblock)); // assuming sizeof superblock < BLOCKSIZE
 
-	// copy elements of superblock into memory, or simply read global variables from buffer directly
-	// superblock elements guaranteed to be the same as global variables, not necessary
+	// printf ("myfs_mount: mounting %s, size=%ld\n", disk_name,
+	// 	(long) finfo.st_size);
+	disk_size = sb.disk_size;
+	disk_blocksize = sb.blocksize;
+	disk_blockcount = sb.disk_blockcount;
+	disk_maxfiles = sb.maxfiles;
+	mount_opts = opts;
+	sprintf(shm_name, "/myfs_%lx_%lx", (unsigned long) finfo.st_dev, (unsigned long) finfo.st_ino);
 
-	// initialize shared memory
-#ifdef _SYS_MMAN_H
-	sprintf(shm_name, "myfs_%s", disk_name);
-	shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, 0666);
-	ftruncate(shm_fd, shm_size);
-	// printf("using shared memory\n");
+	// perform your mount operations here
 
-	// read directory, assuming its size is a little over 1 block
-	dir = mmap(0, sizeof(struct dir), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-	if (dir == MAP_FAILED) {
-		// printf("mapping dir failed\n");
-		exit(1);
+	// map whole disk, otherwise the cache is set up with the rest of the segment
+	if (opts & MYFS_MMAP) {
+		disk_map = mmap(0, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+		if (disk_map == MAP_FAILED) {
+			disk_map = NULL;
+			close(disk_fd);
+			disk_fd = 0;
+			return -1;
+		}
+		map_dirty = calloc(disk_blockcount, 1);
+	} else if (opts & MYFS_AIO) {
+		ioq_init(disk_fd, disk_blocksize); // falls back to synchronous I/O if neither backend can be started
 	}
-#else
-	dir = malloc(sizeof(struct dir));
-#endif
 
-	if (getblock(1, dir) || getblock(2, buf)) {
-		// printf("could not read directory table\n");
-		free(buf);
-		return -1;
+	// tables local to process
+	bmaps = calloc(disk_maxfiles, sizeof(struct blockmap));
+	bmap_gens = calloc(disk_maxfiles, sizeof(uint32_t));
+	wb_pending = calloc(disk_maxfiles, sizeof(int));
+	dir = malloc(sizeof(struct dir));
+	opentable = malloc(open_size(disk_maxfiles));
+	open_init(opentable, disk_maxfiles);
+	open_max = 0;
+
+	// processes sharing the disk set up and tear down the segment one at a time
+	// each holds a read lock on byte 1 of the disk file while it has the disk mounted, so the first one finds it free
+	int first = 1, res;
+	if (opts & MYFS_SHARED) {
+		disk_lock(0, F_WRLCK, 1);
+		first = disk_lock(1, F_WRLCK, 0) == 0;
 	}
-	memcpy(((char *) dir) + BLOCKSIZE, buf, sizeof(struct dir) - BLOCKSIZE);
-
-	/*
-	// read FAT, assuming it is 16 blocks
-	for (int i = 0; i < sizeof(struct fat) / BLOCKSIZE; ++i) {
-		if (getblock(2 + i, ((char *) &fat) + i * BLOCKSIZE)) {
-			printf("could not read FAT\n");
-			free(buf);
-			return -1;
-		}
+	if (first) {
+		res = seg_create(&sb, opts);
+		if (!res)
+			res = seg_load();
+	} else {
+		res = seg_attach(opts);
+	}
+	if (!res && log_starting)
+		res = log_start();
+	if (opts & MYFS_SHARED) {
+		disk_lock(1, res ? F_UNLCK : F_RDLCK, 1);
+		disk_lock(0, F_UNLCK, 1);
 	}
-	*/
 
-	// initialize open file table
-#ifdef _SYS_MMAN_H
-	opentable = mmap(0, sizeof(struct opentable), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 2*BLOCKSIZE);
-	if (opentable == MAP_FAILED) {
-		// printf("mapping opentable failed\n");
-		exit(1);
+	if (res) {
+		// printf("could not read file system\n");
+		seg_free(first);
+		close(disk_fd);
+		disk_fd = 0;
+		return -1;
 	}
-#else
-	opentable = malloc(sizeof(struct opentable));
-#endif
-	open_init(opentable);
 
-	free(buf);
   	return (0);
 }
 
@@ -310,51 +739,64 @@ int myfs_umount()
 	if (disk_fd == 0) // already unmounted or not open
 		return -1;
 
-	char *buf = malloc(BLOCKSIZE);
-
-	// copy elements of superblock from memory, or simply read global variables from buffer directly
-	strcpy(superblock.disk_name, disk_name);
-	superblock.disk_size = disk_size;
-	superblock.disk_blockcount = disk_blockcount;
-
-	// write superblock into buffer
-	memcpy(buf, &superblock, sizeof(struct superblock));
-	if (putblock(0, buf)) {
-		// printf("could not write superblock\n");
-		free(buf);
-		return -1;
+	// write buffers of files left open, which are closed once everything is written back
+	// so that a failed unmount leaves them open and may be retried
+	for (int i = 0; i < MAXOPENFILES; ++i) {
+		struct open_entry *entry = open_get(opentable, i);
+		if (entry && wb_flush(entry))
+			return -1;
+	}
+	// every process commits its changes, the last process to unmount writes metadata and cached blocks back,
+	// leaving the log empty, and removes the segment; deleted files are freed first
+	int last = 1, res;
+	log_stop();
+	if (shared->orphans > 0)
+		log_reclaim();
+	if (mount_opts & MYFS_SHARED) {
+		disk_lock(0, F_WRLCK, 1);
+		last = disk_lock(1, F_WRLCK, 0) == 0;
+	}
+	res = log_commit(0, 1);
+	if (!res && last) {
+		mutex_lock(&shared->log_lock);
+		res = log_checkpoint();
+		pthread_mutex_unlock(&shared->log_lock);
 	}
 
-	// write directory, assuming its size is a little over 1 block
-	memcpy(buf, ((char *) dir) + BLOCKSIZE, sizeof(struct dir) - BLOCKSIZE); // should not wiping buffer here matter?
-	if (putblock(1, dir) || putblock(2, buf)) {
-		// printf("could not write directory table\n");
-		free(buf);
+	// every process syncs blocks it modified in its own mapping
+	if (!res && disk_map)
+		res = map_sync();
+	else if (!res && last)
+		res = cache_destroy(cache);
+
+	if (res) {
+		// printf("could not write back file system\n");
+		if (mount_opts & MYFS_SHARED) {
+			disk_lock(1, F_RDLCK, 1);
+			disk_lock(0, F_UNLCK, 1);
+		}
+		log_start();
 		return -1;
 	}
-#ifndef _SYS_MMAN_H
-	free(dir);
-#endif
-	free(buf);
 
-	/*
-	// write FAT, assuming it is 16 blocks
-	for (int i = 0; i < sizeof(struct fat) / BLOCKSIZE; ++i) {
-		if (putblock(2 + i, ((char *) &fat) + i * BLOCKSIZE)) {
-			printf("could not write FAT\n");
-			return -1;
+	// files left open are closed only now
+	mutex_lock(open_lock);
+	for (int i = 0; i < MAXOPENFILES; ++i) {
+		struct open_entry *entry = open_get(opentable, i);
+		if (entry) {
+			free(entry->wbuf);
+			entry->wbuf = NULL;
+			open_close(opentable, i);
+			opencounts[entry->inum]--;
 		}
 	}
-	*/
+	pthread_mutex_unlock(open_lock);
 
-#ifdef _SYS_MMAN_H
-	if (shm_unlink(shm_name)) {
-		// printf("unlink failed\n");
-		exit(1);
+	seg_free(last);
+	if (mount_opts & MYFS_SHARED) {
+		disk_lock(1, F_UNLCK, 1);
+		disk_lock(0, F_UNLCK, 1);
 	}
-#else
-	free(opentable);
-#endif
 
 	fsync (disk_fd);
 	close (disk_fd);
@@ -362,407 +804,3007 @@ int myfs_umount()
 	return (0);
 }
 
+// Segment
 
-/* create a file with name filename */
-int myfs_create(char *filename)
+// takes (F_RDLCK, F_WRLCK) or releases (F_UNLCK) lock on a byte of disk file, returns -1 if not wait and lock is held
+// these locks are released when their process exits, however it exits
+int disk_lock(int byte, int type, int wait)
 {
-	// retrieve new FCB
-	/* int inum = */ dir_add(dir, filename);
-	/*
-	if (inum == -1) // file already exists
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(struct flock));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = byte;
+	fl.l_len = 1;
+	return fcntl(disk_fd, wait ? F_SETLKW : F_SETLK, &fl);
+}
+
+// kernels that do not know it take the address of a mapping as a hint
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+// reserves n bytes at *off of segment at base, returns their address, NULL if base is
+void *seg_alloc(char *base, size_t *off, size_t n)
+{
+	void *p = base ? base + *off : NULL;
+	*off += (n + 63) & ~(size_t) 63;
+	return p;
+}
+
+// places regions of segment for disk sb at base, recording them in its header, and returns size of segment
+// with base NULL only the size is computed
+size_t seg_layout(char *base, struct superblock *sb, int opts)
+{
+	struct shared hdr;
+	struct shared *sh = base ? (struct shared *) base : &hdr;
+	size_t off = 0;
+	size_t dirsize = sb->fatstart - sb->dirstart, fatsize = sb->extstart - sb->fatstart;
+
+	seg_alloc(base, &off, sizeof(struct shared));
+	sh->log_buf = seg_alloc(base, &off, (size_t) (sb->datastart - sb->logstart) * sb->blocksize);
+	sh->dirbuf = seg_alloc(base, &off, dirsize * sb->blocksize);
+	sh->fat = seg_alloc(base, &off, fatsize * sb->blocksize);
+	sh->fat_dirty = seg_alloc(base, &off, fatsize);
+	sh->fat_freed = seg_alloc(base, &off, fatsize);
+	sh->ext_dirty = seg_alloc(base, &off, sb->maxfiles);
+	sh->freemap.words = seg_alloc(base, &off, (sb->disk_blockcount + 63) / 64 * sizeof(uint64_t));
+	sh->opencounts = seg_alloc(base, &off, sb->maxfiles * sizeof(int));
+	sh->file_gens = seg_alloc(base, &off, sb->maxfiles * sizeof(uint32_t));
+	sh->inode_locks = seg_alloc(base, &off, sb->maxfiles * sizeof(struct rwlock));
+	sh->extlists = seg_alloc(base, &off, sb->maxfiles * sizeof(struct extlist));
+	sh->dir_shadow = seg_alloc(base, &off, dirsize * sb->blocksize);
+	sh->dir_logged = seg_alloc(base, &off, dirsize);
+	sh->fat_shadow = seg_alloc(base, &off, fatsize * sb->blocksize);
+	sh->fat_logged = seg_alloc(base, &off, fatsize);
+	sh->ext_shadow = seg_alloc(base, &off, sb->maxfiles * sizeof(struct extlist));
+	sh->ext_logged = seg_alloc(base, &off, sb->maxfiles);
+	sh->extents = sh->shadow_extents = NULL;
+	if (sb->flags & MYFS_EXTENTS) {
+		sh->extents = seg_alloc(base, &off, (size_t) sb->maxfiles * MAXEXTENTS(sb->blocksize) * sizeof(struct extent));
+		sh->shadow_extents = seg_alloc(base, &off, (size_t) sb->maxfiles * MAXEXTENTS(sb->blocksize) * sizeof(struct extent));
+	}
+
+	// cache goes last, page aligned
+	off = (off + 4095) & ~(size_t) 4095;
+	if (!(opts & MYFS_MMAP))
+		off += cache_size(cache_frames, sb->blocksize);
+	return off;
+}
+
+// sets up segment for disk sb, in shared memory if mounted with MYFS_SHARED, else in memory of process
+// pages of segment are only backed by memory once used, so extents of every file may be reserved
+int seg_create(struct superblock *sb, int opts)
+{
+	int shm = (opts & MYFS_SHARED) != 0, fd = -1;
+	size_t size = seg_layout(NULL, sb, opts);
+	char *base;
+
+	if (shm) {
+		// segment left over by processes that died while having the disk mounted is started afresh
+		shm_unlink(shm_name);
+		fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0666);
+		if (fd == -1 || ftruncate(fd, size)) {
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	} else {
+		base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (base == MAP_FAILED) {
+		if (shm)
+			shm_unlink(shm_name);
 		return -1;
-	// printf("created file %s with fd %d\n", filename, inum);
+	}
+
+	shared = (struct shared *) base;
+	seg_layout(base, sb, opts);
+	shared->addr = base;
+	shared->size = size;
+	shared->opts = opts;
+	shared->superblock = *sb;
+	shared->newfile_hint = sb->datastart + (sb->disk_blockcount - sb->datastart) / 3;
+	rwlock_init_wrpref(&shared->op_lock, shm);
+	rwlock_init(&shared->dir_lock, shm);
+	mutex_init(&shared->open_lock, shm);
+	mutex_init(&shared->alloc_lock, shm);
+	mutex_init(&shared->log_lock, shm);
+	for (int i = 0; i < sb->maxfiles; ++i)
+		rwlock_init(&shared->inode_locks[i], shm);
+	if (!(opts & MYFS_MMAP))
+		cache_init(&shared->cache, cache_frames, sb->blocksize, base + size - cache_size(cache_frames, sb->blocksize), shm);
+
+	seg_use();
 	return 0;
-	*/
-	return myfs_open(filename);
 }
 
-
-/* open file filename */
-int myfs_open(char *filename)
+// maps segment set up by another process at the address it is mapped at there
+int seg_attach(int opts)
 {
-	int index = -1;
-	int inum = dir_get(dir, filename);
+	struct shared hdr;
+	int fd = shm_open(shm_name, O_RDWR, 0);
+	if (fd == -1)
+		return -1;
 
-	// binary search through dir
-	// if not found return index
-	// else create new open file table entry
-	// copy size and start from dir entry, curr = start, offset = 0
-	if (inum == -1) {
-		// printf("file %s does not exist\n", filename);
+	// every process must use the cache, or every process must map the disk
+	if (pread(fd, &hdr, sizeof(struct shared), 0) != sizeof(struct shared) ||
+	    (hdr.opts & MYFS_MMAP) != (opts & MYFS_MMAP)) {
+		close(fd);
 		return -1;
 	}
 
-	// create new open file table entry for index
-	index = open_add(opentable, filename, inum, dir);
-	if (index == -1) {
-		// printf("cannot open file %s\n", filename);
+	void *base = mmap(hdr.addr, hdr.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+	if (base != hdr.addr) {
+		munmap(base, hdr.size);
 		return -1;
 	}
 
-	return (index);
+	shared = base;
+	seg_use();
+	return 0;
 }
 
-/* close file filename */
-int myfs_close(int fd)
+// points globals at segment
+void seg_use()
 {
-	// check if open first
-	// write cached blocks of file into disk, if any
-	// remove from open file table
-	return open_close(opentable, fd);
+	superblock = &shared->superblock;
+	cache = &shared->cache;
+	freemap = &shared->freemap;
+	op_lock = &shared->op_lock;
+	dir_lock = &shared->dir_lock;
+	open_lock = &shared->open_lock;
+	alloc_lock = &shared->alloc_lock;
+	inode_locks = shared->inode_locks;
+	fat = shared->fat;
+	fat_dirty = shared->fat_dirty;
+	fat_freed = shared->fat_freed;
+	refs = (uint16_t *) ((char *) fat + (size_t) (superblock->refstart - superblock->fatstart) * disk_blocksize);
+	gaps = (uint32_t *) ((char *) fat + (size_t) (superblock->gapstart - superblock->fatstart) * disk_blocksize);
+	ext_dirty = shared->ext_dirty;
+	opencounts = shared->opencounts;
+	file_gens = shared->file_gens;
+	extlists = shared->extlists;
+	dir_attach(dir, shared->dirbuf, disk_maxfiles);
 }
 
-int myfs_delete(char *filename)
+// reads directory, FAT and extent table into new segment, and replays log onto them
+int seg_load()
 {
-	struct inode inode;
-
-	// first check if open
-	if (open_isopen(opentable, filename, dir)) {
-		// printf("file %s is open\n", filename);
+	// directory blocks, read with a single I/O
+	int dirsize = superblock->fatstart - superblock->dirstart;
+	int *blks = malloc(dirsize * sizeof(int));
+	for (int i = 0; i < dirsize; ++i)
+		blks[i] = superblock->dirstart + i;
+	int res = readblocks(blks, dirsize, dir->buf);
+	free(blks);
+	if (res) {
+		// printf("could not read directory\n");
 		return -1;
 	}
 
-	// retrieve file, checking if it actually exists
-	// then remove it from directory entry and read its inode
-	int inum = dir_remove(dir, filename, &inode);
-	if (inum == -1) {
-		// printf("file %s does not exist\n", filename);
+	// read FAT, FATSIZE blocks starting after directory
+	if (fat_load()) {
+		// printf("could not read FAT\n");
 		return -1;
 	}
 
-	// deallocate data blocks in order
-	BLOCKTYPE i = inode.start, j;
-	while ((j = fat_getnext(i)) != 0) {
-		fat_dealloc(i); // is more needed for deallocation?
-		i = j;
+	// read extent table following FAT
+	if ((superblock->flags & MYFS_EXTENTS) && ext_load()) {
+		// printf("could not read extent table\n");
+		return -1;
 	}
 
-	// then remove directory entry etc.
-	// already done in beginning
+	// changes committed since last checkpoint
+	if (log_replay()) {
+		// printf("could not replay log\n");
+		return -1;
+	}
+	fat_buildmap();
+	log_snapshot(0);
 
-	// write to disk if blocks cached
+	// files deleted with MYFS_LAZYFREE and not freed before unmount or a crash are left to the log thread
+	for (int inum = 0; inum < disk_maxfiles; ++inum)
+		shared->orphans += dir->fcbs[inum].valid == FCB_ORPHAN;
 
-	return (0);
+	return 0;
 }
 
-int myfs_read(int fd, void *buf, int n)
+// writes superblock, blocks stay in the cache or the disk mapping
+int sb_store()
 {
-	int bytes_read = -1;
+	char *buf = calloc(1, disk_blocksize);
+	int res;
 
-	if (n > MAXREADWRITE)
-		return bytes_read;
+	// copy elements of superblock from memory, or simply read global variables from buffer directly
+	strcpy(superblock->disk_name, disk_name);
 
-	// check if file open
-	struct open_entry *entry = open_get(opentable, fd);
+	// write superblock into buffer
+	memcpy(buf, superblock, sizeof(struct superblock));
+	res = writeblock(0, buf);
+	free(buf);
+	return res;
+}
 
-	if (entry == NULL || entry->inode->size == 0) // empty file
-		return bytes_read;
+// writes directory blocks logged since last checkpoint, as of last commit
+int dir_store()
+{
+	int dirsize = superblock->fatstart - superblock->dirstart;
 
-	// retrieve current block
-	// read byte by byte until offset == size or bytes_read == n
-	// if current block changes (size / BLOCKSIZE), retrieve new block and update curr
+	for (int i = 0; i < dirsize; ++i) {
+		if (!shared->dir_logged[i])
+			continue;
+		if (writeblock(superblock->dirstart + i, shared->dir_shadow + (size_t) i * disk_blocksize))
+			return -1;
+		shared->dir_logged[i] = 0;
+	}
+	return 0;
+}
 
-	char *blockbuf = malloc(BLOCKSIZE);
-	int siz; // how many bytes to read
+// frees tables of process and unmaps segment, the last process to do so removes it
+void seg_free(int last)
+{
+	// blocks still being read ahead go into the segment
+	if (!disk_map)
+		ioq_drain();
+
+	for (int i = 0; i < disk_maxfiles; ++i)
+		bmap_free(&bmaps[i]);
+	free(bmaps);
+	free(bmap_gens);
+	free(wb_pending);
+	free(dir);
+	free(opentable);
 
-	if (getblock(entry->curr, blockbuf)) {
-		// printf("reading block %d failed\n", entry->curr);
-		free(blockbuf);
-		return bytes_read;
+	if (shared) {
+		munmap(shared->addr, shared->size);
+		shared = NULL;
 	}
+	if (last && (mount_opts & MYFS_SHARED))
+		shm_unlink(shm_name);
+
+	if (disk_map) {
+		munmap(disk_map, disk_size);
+		free(map_dirty);
+		disk_map = NULL;
+	} else {
+		ioq_destroy();
+	}
+}
 
-	// read byte by byte, reread block if necessary
-	bytes_read = 0;
-	while (bytes_read < n && entry->offset < entry->inode->size) {
-		// copy byte from buffer
-		// buf[bytes_read++] = blockbuf[entry->offset++ % BLOCKSIZE];
-
-		// try to read remaining bytes
-		siz = n - bytes_read;
-		if (siz > entry->inode->size - entry->offset) // will reach EOF
-			siz = entry->inode->size - entry->offset;
-		if (siz > BLOCKSIZE - entry->offset % BLOCKSIZE) // will reach end of block
-			siz = BLOCKSIZE - entry->offset % BLOCKSIZE;
-
-		memcpy(buf + bytes_read, blockbuf + entry->offset % BLOCKSIZE, siz);
-		bytes_read += siz;
-		entry->offset += siz;
-
-		// change current block if necessary
-		if (entry->offset % BLOCKSIZE == 0) { // only execute if will continue
-			entry->curr = fat_getnext(entry->curr);
-			// printf("next block %d\n", entry->curr);
-			if (entry->curr == (BLOCKTYPE) -1 || getblock(entry->curr, blockbuf))
-				break;
-		}
+// Metadata log
 
-		// printf("read %d bytes, offset %d, block %d, size %d\n", siz, entry->offset, entry->curr, entry->inode->size);
-		// printf("read %s\n", buf + bytes_read);
-	}
+pthread_t log_thread; // commits for this process
+int log_reclaiming = 1; // log thread frees files deleted with MYFS_LAZYFREE before committing, except while checking
+pthread_mutex_t log_wait = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+int log_running;
 
-	/*
-	if (bytes_read < n && entry->offset < entry->inode->size)
-		printf("reading block %d failed\n", entry->curr);
-	*/
+// calls changing metadata hold operation lock for reading, a commit takes it for writing to see their changes whole
+void op_begin()
+{
+	rwlock_rdlock(op_lock);
+}
 
-	free(blockbuf);
-	return (bytes_read) ?: -1; // should return -1 if trying to read after EOF
+void op_end()
+{
+	__atomic_store_n(&shared->log_pending, 1, __ATOMIC_RELAXED);
+	rwlock_unlock(op_lock);
 }
 
-int myfs_write(int fd, void *buf, int n)
+// FNV-1a
+uint32_t log_sum(char *buf, int len)
 {
-	int bytes_written = -1;
-	int siz;
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < len; ++i)
+		h = (h ^ (uint8_t) buf[i]) * 16777619u;
+	return h;
+}
 
-	if (n > MAXREADWRITE)
-		return bytes_written;
+// appends record with n bytes of data to the *len bytes of records in buf, which holds size bytes
+// returns where its data goes, copied from data unless NULL, or NULL if record does not fit
+char *log_append(char *buf, int *len, int size, int type, uint64_t where, void *data, int n)
+{
+	int need = (sizeof(struct log_record) + n + 7) & ~7;
+	if (need > size - *len)
+		return NULL;
+
+	struct log_record *rec = (struct log_record *) (buf + *len);
+	rec->type = type;
+	rec->len = n;
+	rec->where = where;
+	if (data)
+		memcpy(rec + 1, data, n);
+	memset((char *) (rec + 1) + n, 0, need - sizeof(struct log_record) - n);
+	*len += need;
+	return (char *) (rec + 1);
+}
 
-	// check if file open
-	struct open_entry *entry = open_get(opentable, fd);
+// gathers changes to metadata since last commit as records in buf of size bytes, holding operation lock for writing
+// returns length of records, -1 if they do not fit
+int log_collect(char *buf, int size)
+{
+	size_t dirbytes = (size_t) (superblock->fatstart - superblock->dirstart) * disk_blocksize;
+	int len = 0;
+
+	// runs of changed 64 byte chunks of directory
+	for (size_t i = 0, j; i < dirbytes; i = j) {
+		for (j = i; j < dirbytes && memcmp(shared->dirbuf + j, shared->dir_shadow + j, 64); j += 64)
+			;
+		if (j > i && !log_append(buf, &len, size, LOG_DIR, i, shared->dirbuf + i, j - i))
+			return -1;
+		if (j == i)
+			j += 64;
+	}
 
-	if (entry == NULL)
-		return bytes_written;
+	// dirty FAT blocks, unless changed back
+	for (int i = 0; i < FATSIZE; ++i) {
+		char *b = (char *) fat + (size_t) i * disk_blocksize;
+		if (fat_dirty[i] && memcmp(b, (char *) shared->fat_shadow + (size_t) i * disk_blocksize, disk_blocksize) &&
+		    !log_append(buf, &len, size, LOG_FAT, i, b, disk_blocksize))
+			return -1;
+	}
 
-	// same as read, instead if offset == size and bytes_written < n,
-	// increment size and if necessary allocate new block on fat
+	// extent lists of files that changed them
+	for (int inum = 0; inum < disk_maxfiles && (superblock->flags & MYFS_EXTENTS); ++inum) {
+		struct extlist *list = &extlists[inum];
+		uint32_t hdr[2] = { list->overflow, list->count };
+		char *p;
 
-	// if no blocks, allocate in beginning
-	if (entry->inode->size == 0) {
-		entry->inode->start = entry->curr = fat_setnext(0);
-		if (!entry->inode->start) // no space available
-			return bytes_written;
+		if (!ext_dirty[inum])
+			continue;
+		if ((p = log_append(buf, &len, size, LOG_EXT, inum, NULL, sizeof(hdr) + list->count * sizeof(struct extent))) == NULL)
+			return -1;
+		memcpy(p, hdr, sizeof(hdr));
+		memcpy(p + sizeof(hdr), list->ext, list->count * sizeof(struct extent));
 	}
 
-	// current block
-	char *blockbuf = malloc(BLOCKSIZE);
-	if (getblock(entry->curr, blockbuf)) {
-		free(blockbuf);
-		return bytes_written;
-	}
+	return len;
+}
 
-	bytes_written = 0;
-	while (bytes_written < n) {
-		// blockbuf[entry->offset++] = buf[bytes_written++];
+// applies len bytes of records in buf to directory, FAT and extent lists given, marking what they change as logged
+// returns -1 if a record does not apply to disk
+int log_apply(char *buf, int len, char *dirbuf, BLOCKTYPE *fatbuf, struct extlist *lists)
+{
+	size_t dirbytes = (size_t) (superblock->fatstart - superblock->dirstart) * disk_blocksize;
+	int max = MAXEXTENTS(disk_blocksize);
 
-		// try to write remaining blocks
-		siz = n - bytes_written;
-		if (siz > BLOCKSIZE - entry->offset % BLOCKSIZE) // will reach end of block
-			siz = BLOCKSIZE - entry->offset % BLOCKSIZE;
+	for (int off = 0; off < len; ) {
+		struct log_record *rec = (struct log_record *) (buf + off);
+		char *data = (char *) (rec + 1);
+		uint32_t hdr[2];
 
-		memcpy(blockbuf + entry->offset % BLOCKSIZE, buf + bytes_written, siz);
-		bytes_written += siz;
-		entry->offset += siz;
+		if (len - off < (int) sizeof(struct log_record) || rec->len > len - off - sizeof(struct log_record))
+			return -1;
 
-		if (entry->offset >= entry->inode->size)
-			entry->inode->size = entry->offset;
-		if (entry->offset % BLOCKSIZE == 0) {
-			if (putblock(entry->curr, blockbuf))
+		switch (rec->type) {
+		case LOG_DIR:
+			if (rec->len == 0 || rec->where > dirbytes || rec->len > dirbytes - rec->where)
+				return -1;
+			memcpy(dirbuf + rec->where, data, rec->len);
+			for (size_t b = rec->where / disk_blocksize; b <= (rec->where + rec->len - 1) / disk_blocksize; ++b)
+				shared->dir_logged[b] = 1;
+			break;
+		case LOG_FAT:
+			if (rec->where >= (uint64_t) FATSIZE || rec->len != (uint32_t) disk_blocksize)
+				return -1;
+			memcpy((char *) fatbuf + rec->where * disk_blocksize, data, disk_blocksize);
+			shared->fat_logged[rec->where] = 1;
+			break;
+		case LOG_EXT:
+			if (!(superblock->flags & MYFS_EXTENTS) || rec->where >= (uint64_t) disk_maxfiles || rec->len < sizeof(hdr))
+				return -1;
+			memcpy(hdr, data, sizeof(hdr));
+			if (hdr[1] > (uint32_t) max || rec->len != sizeof(hdr) + hdr[1] * sizeof(struct extent))
+				return -1;
+			lists[rec->where].overflow = hdr[0];
+			lists[rec->where].count = hdr[1];
+			memcpy(lists[rec->where].ext, data + sizeof(hdr), hdr[1] * sizeof(struct extent));
+			shared->ext_logged[rec->where] = 1;
+			break;
+		default:
+			return -1;
+		}
+
+		off += (sizeof(struct log_record) + rec->len + 7) & ~7;
+	}
+
+	return 0;
+}
+
+// makes metadata as it is the last committed, holding log lock and operation lock for writing
+// if mark, what changed since last commit is marked logged, to be written at next checkpoint
+void log_snapshot(int mark)
+{
+	int dirsize = superblock->fatstart - superblock->dirstart;
+
+	memcpy(shared->dir_shadow, shared->dirbuf, (size_t) dirsize * disk_blocksize);
+	if (mark)
+		memset(shared->dir_logged, 1, dirsize);
+
+	for (int i = 0; i < FATSIZE; ++i) {
+		if (fat_dirty[i] || !mark)
+			memcpy((char *) shared->fat_shadow + (size_t) i * disk_blocksize, (char *) fat + (size_t) i * disk_blocksize, disk_blocksize);
+		if (fat_dirty[i] && mark)
+			shared->fat_logged[i] = 1;
+		fat_dirty[i] = 0;
+	}
+
+	for (int inum = 0; inum < disk_maxfiles && (superblock->flags & MYFS_EXTENTS); ++inum) {
+		if (ext_dirty[inum] || !mark)
+			ext_copy(&shared->ext_shadow[inum], &extlists[inum]);
+		if (ext_dirty[inum] && mark)
+			shared->ext_logged[inum] = 1;
+		ext_dirty[inum] = 0;
+	}
+}
+
+// marks metadata changed by records in buf dirty again, after they failed to be committed
+void log_redirty(char *buf, int len)
+{
+	rwlock_wrlock(op_lock);
+	for (int off = 0; off < len; ) {
+		struct log_record *rec = (struct log_record *) (buf + off);
+		if (rec->type == LOG_FAT)
+			fat_dirty[rec->where] = 1;
+		else if (rec->type == LOG_EXT)
+			ext_dirty[rec->where] = 1;
+		off += (sizeof(struct log_record) + rec->len + 7) & ~7;
+	}
+	shared->log_pending = 1;
+	rwlock_unlock(op_lock);
+}
+
+// writes back blocks of the cache a batch depends on before it: every dirty block,
+// or without all only metadata blocks, blocks of the file being synced having been written back by the caller
+int log_flush(int all)
+{
+	if (disk_map)
+		return 0;
+	return all ? cache_flush(cache) : cache_flushrange(cache, 0, DATASTART);
+}
+
+// writes batch of len bytes of records at end of log, starting it over first if it does not fit, holding log lock
+// blocks in the cache are written back before it as log_flush does, and made durable by the same fdatasync
+int log_write(int len, int all)
+{
+	struct log_batch *hdr = (struct log_batch *) shared->log_buf;
+	char *recs = shared->log_buf + sizeof(struct log_batch);
+	int n = (sizeof(struct log_batch) + len + disk_blocksize - 1) / disk_blocksize, res = 0;
+
+	if (shared->log_tail + n > LOGSIZE)
+		res = log_checkpoint();
+
+	if (!res) {
+		void **bufs = malloc(n * sizeof(void *));
+		hdr->magic = LOG_MAGIC;
+		hdr->nblocks = n;
+		hdr->seq = shared->log_seq;
+		hdr->len = len;
+		hdr->sum = log_sum(recs, len);
+		memset(recs + len, 0, (size_t) n * disk_blocksize - sizeof(struct log_batch) - len);
+		for (int i = 0; i < n; ++i)
+			bufs[i] = shared->log_buf + (size_t) i * disk_blocksize;
+		if (log_flush(all) || putblocks(LOGBLOCK + shared->log_tail, n, bufs) || disk_sync())
+			res = -1;
+		free(bufs);
+	}
+
+	if (res) {
+		log_redirty(recs, len);
+	} else {
+		shared->log_tail += n;
+		shared->log_seq++;
+		log_apply(recs, len, shared->dir_shadow, shared->fat_shadow, shared->ext_shadow);
+	}
+	return res;
+}
+
+// commits changes to metadata since last commit as one batch, written to the log with a single fdatasync
+// changes of every call that returned before are in it, so concurrent calls share the commit
+// blocks written since last commit are written back even if no metadata changed
+// with sync, blocks already written to the disk file are made durable even if there is nothing to commit
+// without all, only metadata blocks of the cache are written back, see log_flush
+int log_commit(int sync, int all)
+{
+	int len = 0, res = 0, taken = 0;
+
+	mutex_lock(&shared->log_lock);
+
+	// changes are taken between calls, shadows are left as of last commit until batch is written
+	if (__atomic_load_n(&shared->log_pending, __ATOMIC_RELAXED)) {
+		rwlock_wrlock(op_lock);
+
+		// blocks held in write buffers go into the cache first, so that no size taken covers data not written
+		// buffers of other processes are only left in private mounts, where no other process commits
+		for (int inum = 0; inum < disk_maxfiles && !res; ++inum) {
+			if (!wb_pending[inum])
+				continue;
+			rwlock_wrlock(&inode_locks[inum]);
+			res = wb_flushfile(inum, NULL);
+			rwlock_unlock(&inode_locks[inum]);
+		}
+		if (res) { // left to next commit
+			rwlock_unlock(op_lock);
+			pthread_mutex_unlock(&shared->log_lock);
+			return -1;
+		}
+
+		taken = 1;
+		__atomic_store_n(&shared->log_pending, 0, __ATOMIC_RELAXED);
+		len = log_collect(shared->log_buf + sizeof(struct log_batch), LOGSIZE * disk_blocksize - sizeof(struct log_batch));
+		if (len >= 0) {
+			memset(fat_dirty, 0, FATSIZE);
+			memset(ext_dirty, 0, disk_maxfiles);
+		} else {
+			// batch would not fit in the whole log, metadata is written in place as it is, not atomically
+			log_snapshot(1);
+		}
+		rwlock_unlock(op_lock);
+	}
+
+	if (len < 0)
+		res = log_flush(all) || log_checkpoint() ? -1 : 0;
+	else if (len > 0)
+		res = log_write(len, all);
+	else if ((taken && log_flush(all)) || (sync && disk_sync()))
+		res = -1;
+
+	// blocks freed as of the batch may now be allocated again
+	if (taken && !res) {
+		mutex_lock(alloc_lock);
+		fat_releasefreed();
+		pthread_mutex_unlock(alloc_lock);
+	}
+
+	pthread_mutex_unlock(&shared->log_lock);
+	return res;
+}
+
+// makes metadata blocks written so far durable
+int meta_sync()
+{
+	if (!disk_map && cache_flushrange(cache, 0, DATASTART))
+		return -1;
+	return disk_sync();
+}
+
+// writes metadata as of last commit in place, then starts log over, holding log lock
+int log_checkpoint()
+{
+	// log is dropped only once everything it holds is on disk
+	if (((superblock->flags & MYFS_EXTENTS) && ext_store()) || fat_sync() || dir_store() || meta_sync())
+		return -1;
+
+	superblock->logseq = shared->log_seq;
+	if (sb_store() || meta_sync())
+		return -1;
+	shared->log_tail = 0;
+	return 0;
+}
+
+// replays batches committed since last checkpoint onto metadata loaded from disk
+// returns -1 if a batch does not apply to disk
+int log_replay()
+{
+	struct log_batch *hdr = (struct log_batch *) shared->log_buf;
+	char *recs = shared->log_buf + sizeof(struct log_batch);
+	void **bufs = malloc(LOGSIZE * sizeof(void *));
+	uint64_t seq = superblock->logseq;
+	int tail = 0, res = 0;
+
+	for (int i = 0; i < LOGSIZE; ++i)
+		bufs[i] = shared->log_buf + (size_t) i * disk_blocksize;
+
+	// batches follow each other from start of log, up to the first one that is stale or was not written whole
+	while (tail < LOGSIZE && getblocks(LOGBLOCK + tail, 1, bufs) == 0) {
+		if (hdr->magic != LOG_MAGIC || hdr->seq != seq || hdr->nblocks == 0 || hdr->nblocks > (uint32_t) (LOGSIZE - tail) ||
+		    hdr->len > hdr->nblocks * disk_blocksize - sizeof(struct log_batch))
+			break;
+		if (getblocks(LOGBLOCK + tail + 1, hdr->nblocks - 1, bufs + 1) || log_sum(recs, hdr->len) != hdr->sum)
+			break;
+		if (log_apply(recs, hdr->len, shared->dirbuf, fat, extlists)) {
+			res = -1;
+			break;
+		}
+		tail += hdr->nblocks;
+		seq++;
+	}
+
+	free(bufs);
+	shared->log_tail = tail;
+	shared->log_seq = seq;
+	return res;
+}
+
+void log_reclaim()
+{
+	op_begin();
+	rwlock_wrlock(dir_lock);
+	file_reclaim();
+	rwlock_unlock(dir_lock);
+	op_end();
+}
+
+// gives back blocks freed since last commit, and those of files deleted with MYFS_LAZYFREE, by committing
+// called holding no lock but an open entry's, once a call ran out of space, returns 1 if it may be retried
+int log_freespace()
+{
+	int freed = 0;
+
+	if (log_reclaiming && __atomic_load_n(&shared->orphans, __ATOMIC_RELAXED))
+		log_reclaim();
+	mutex_lock(alloc_lock);
+	for (int i = 0; i <= FATBLOCK(disk_blockcount - 1) - FATBLOCK(0) && !freed; ++i)
+		freed = fat_freed[i];
+	pthread_mutex_unlock(alloc_lock);
+
+	return freed && log_commit(0, 1) == 0;
+}
+
+void *log_run(void *arg)
+{
+	struct timespec t;
+
+	pthread_mutex_lock(&log_wait);
+	while (log_running) {
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_nsec += LOGINTERVAL * 1000000L;
+		t.tv_sec += t.tv_nsec / 1000000000L;
+		t.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&log_wake, &log_wait, &t);
+		if (!log_running)
+			break;
+		pthread_mutex_unlock(&log_wait);
+		if (log_reclaiming && __atomic_load_n(&shared->orphans, __ATOMIC_RELAXED))
+			log_reclaim();
+		log_commit(0, 1); // left to next commit if it fails
+		pthread_mutex_lock(&log_wait);
+	}
+	pthread_mutex_unlock(&log_wait);
+	return NULL;
+}
+
+// starts thread of process committing changes periodically, changes of other processes included
+int log_start()
+{
+	log_running = 1;
+	if (pthread_create(&log_thread, NULL, log_run, NULL)) {
+		log_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void log_stop()
+{
+	if (!log_running)
+		return;
+	pthread_mutex_lock(&log_wait);
+	log_running = 0;
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_wait);
+	pthread_join(log_thread, NULL);
+}
+
+/* set number of cache frames used by subsequent mounts */
+int myfs_cachesize(int frames)
+{
+	if (frames <= 0 || disk_fd != 0)
+		return -1;
+	cache_frames = frames;
+	return 0;
+}
+
+
+/* create a file with name filename */
+int myfs_create(char *filename)
+{
+	// retrieve new FCB, its extent list starts empty
+	op_begin();
+	rwlock_wrlock(dir_lock);
+	int k = dir_add(dir, filename);
+	STAT_ADD(dir_lookups, 1);
+	if (k == -1 && dir->hdr->minfree == -1 && shared->orphans > 0) {
+		// every fcb is taken, some by deleted files the log thread has yet to free
+		file_reclaim();
+		k = dir_add(dir, filename);
+	}
+	if (k != -1) {
+		int inum = dir->entries[k].inum;
+		mutex_lock(alloc_lock);
+		ext_dirty[inum] = 1;
+		pthread_mutex_unlock(alloc_lock);
+	}
+	rwlock_unlock(dir_lock);
+	op_end();
+	/*
+	if (k == -1) // file already exists
+		return -1;
+	// printf("created file %s with fd %d\n", filename, k);
+	return 0;
+	*/
+	return myfs_open(filename);
+}
+
+
+/* open file filename */
+int myfs_open(char *filename)
+{
+	int index = -1;
+
+	// file may not be deleted until it is in open file table
+	rwlock_rdlock(dir_lock);
+	int inum = dir_get(dir, filename);
+	STAT_ADD(dir_lookups, 1);
+
+	// binary search through dir
+	// if not found return index
+	// else create new open file table entry
+	// copy size and start from dir entry, curr = start, offset = 0
+	if (inum == -1) {
+		// printf("file %s does not exist\n", filename);
+		rwlock_unlock(dir_lock);
+		return -1;
+	}
+
+	// create new open file table entry for index
+	rwlock_rdlock(&inode_locks[inum]);
+	mutex_lock(open_lock);
+	index = open_add(opentable, filename, inum, dir);
+
+	// first open in process builds block map shared by all its entries of inum, no other entry may use it yet
+	if (index != -1 && opentable->counts[inum] == 1) {
+		if (bmap_build(inum, &bmaps[inum])) {
+			open_close(opentable, index);
+			index = -1;
+		} else {
+			bmap_gens[inum] = file_gens[inum];
+		}
+	}
+	if (index != -1) {
+		opencounts[inum]++;
+		if (opentable->filenum > open_max)
+			open_max = opentable->filenum;
+	}
+	pthread_mutex_unlock(open_lock);
+	rwlock_unlock(&inode_locks[inum]);
+	rwlock_unlock(dir_lock);
+
+	return (index);
+}
+
+/* close file filename */
+int myfs_close(int fd)
+{
+	// check if open first
+	// write cached blocks of file into disk, if any
+	// remove from open file table
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return -1;
+
+	int inum = entry->inum, res;
+	if (inode_wrlock(inum)) {
+		pthread_mutex_unlock(&entry->lock);
+		return -1;
+	}
+	mutex_lock(open_lock);
+	res = wb_flush(entry);
+	if (!res) {
+		free(entry->wbuf);
+		entry->wbuf = NULL;
+		res = open_close(opentable, fd);
+	}
+	if (!res)
+		opencounts[inum]--;
+	if (!res && opentable->counts[inum] == 0)
+		bmap_free(&bmaps[inum]);
+	pthread_mutex_unlock(open_lock);
+	rwlock_unlock(&inode_locks[inum]);
+	pthread_mutex_unlock(&entry->lock);
+	return res;
+}
+
+int myfs_delete(char *filename)
+{
+	struct inode inode;
+
+	// first check if open, in any process
+	op_begin();
+	rwlock_wrlock(dir_lock);
+	int inum = dir_get(dir, filename);
+	STAT_ADD(dir_lookups, 1);
+	mutex_lock(open_lock);
+	int isopen = inum != -1 && opencounts[inum];
+	pthread_mutex_unlock(open_lock);
+	if (isopen) {
+		// printf("file %s is open\n", filename);
+		rwlock_unlock(dir_lock);
+		op_end();
+		return -1;
+	}
+
+	if (inum == -1) {
+		// printf("file %s does not exist\n", filename);
+		rwlock_unlock(dir_lock);
+		op_end();
+		return -1;
+	}
+
+	// with MYFS_LAZYFREE the file only leaves the directory, its fcb stays taken until the log thread frees its blocks
+	if (mount_opts & MYFS_LAZYFREE) {
+		dir_unlink(dir, filename);
+		shared->orphans++;
+	} else if (file_free(inum) == 0) {
+		dir_remove(dir, filename, &inode);
+	} else {
+		inum = -1;
+	}
+	rwlock_unlock(dir_lock);
+	op_end();
+	if (inum == -1)
+		return -1;
+
+	// write to disk if blocks cached
+
+	return (0);
+}
+
+// deallocates blocks of file in order, unless other files hold them, and empties its extent list
+// holding directory lock for writing, for a file being deleted
+int file_free(int inum)
+{
+	struct blockmap map;
+
+	if (bmap_build(inum, &map))
+		return -1;
+	mutex_lock(alloc_lock);
+	fat_releaseblocks(map.blocks, map.count);
+	bmap_free(&map);
+
+	if (superblock->flags & MYFS_EXTENTS) {
+		if (extlists[inum].overflow)
+			fat_dealloc(extlists[inum].overflow);
+		ext_attach(&extlists[inum], extlists[inum].ext, extlists[inum].cap);
+		ext_dirty[inum] = 1;
+	}
+	pthread_mutex_unlock(alloc_lock);
+	return 0;
+}
+
+// frees blocks and fcbs of files deleted with MYFS_LAZYFREE, holding operation lock and directory lock for writing
+void file_reclaim()
+{
+	for (int inum = 0; inum < disk_maxfiles && shared->orphans > 0; ++inum)
+		if (dir->fcbs[inum].valid == FCB_ORPHAN && file_free(inum) == 0) {
+			dir_freefcb(dir, inum);
+			shared->orphans--;
+		}
+}
+
+int myfs_read(int fd, void *buf, int n)
+{
+	int bytes_read = -1;
+
+	// check if file open
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return bytes_read;
+
+	// readers of a file proceed together, once pending writes are flushed
+	if (inode_rdlock(entry->inum) == 0) {
+		bytes_read = file_read(entry, buf, n);
+		rwlock_unlock(&inode_locks[entry->inum]);
+	}
+	pthread_mutex_unlock(&entry->lock);
+	return bytes_read;
+}
+
+// reads from open entry, holding its lock and read lock of its inode
+int file_read(struct open_entry *entry, void *buf, int n)
+{
+	int bytes_read = -1;
+
+	if (entry->inode->size == 0 || n < 0) // empty file
+		return bytes_read;
+
+	// look up blocks spanned by the request in block map
+	// runs of full blocks are read directly into buf, partial blocks at either end through a bounce buffer
+	// holes, and blocks past the end of the chain within size, read as zeros without any I/O
+
+	struct blockmap *map = &bmaps[entry->inum];
+	int64_t end = entry->offset + n; // offset after read
+	if (end > entry->inode->size || end < entry->offset)
+		end = entry->inode->size;
+	if (end <= entry->offset) // EOF
+		return bytes_read;
+
+	char *bounce = NULL;
+	int *blks = NULL;
+	int i, k, siz; // how many bytes to read
+
+	int64_t start = entry->offset;
+	bytes_read = 0;
+	while (entry->offset < end) {
+		int blk = entry->offset / disk_blocksize;
+
+		if (entry->offset % disk_blocksize == 0 && end - entry->offset >= disk_blocksize) {
+			// full blocks, consecutive ones on disk read together, up to the next hole or the end of one
+			k = (end - entry->offset) / disk_blocksize;
+			for (i = 0; i < k && bmap_get(map, blk + i) == 0; ++i)
+				;
+			if (i) {
+				memset(buf + bytes_read, 0, (size_t) i * disk_blocksize);
+			} else {
+				if (blks == NULL)
+					blks = malloc(k * sizeof(int));
+				for (i = 0; i < k && (blks[i] = bmap_get(map, blk + i)) != 0; ++i)
+					;
+				if (readblocks(blks, i, buf + bytes_read))
+					break;
+			}
+			siz = i * disk_blocksize;
+		} else {
+			// partial block, mapped blocks are copied from directly
+			int b = bmap_get(map, blk);
+			char *src = NULL;
+			if (b && disk_map) {
+				src = mapblock(b);
+			} else if (b) {
+				if (bounce == NULL)
+					bounce = malloc(disk_blocksize);
+				if (readblocks(&b, 1, bounce))
+					break;
+				src = bounce;
+			}
+
+			siz = end - entry->offset;
+			if (siz > disk_blocksize - entry->offset % disk_blocksize) // will reach end of block
+				siz = disk_blocksize - entry->offset % disk_blocksize;
+			if (src)
+				memcpy(buf + bytes_read, src + entry->offset % disk_blocksize, siz);
+			else
+				memset(buf + bytes_read, 0, siz);
+		}
+
+		bytes_read += siz;
+		entry->offset += siz;
+	}
+	entry->curr = bmap_get(map, entry->offset / disk_blocksize);
+	if (bytes_read)
+		file_readahead(entry, start, entry->offset);
+
+	free(bounce);
+	free(blks);
+	return (bytes_read) ?: -1; // should return -1 if trying to read after EOF
+}
+
+// returns block holding logical block i of open file, allocating it if it is a hole or past the end of its chain
+// a block shared with clones is copied first, unless whole, when it is about to be overwritten whole
+// counts of blocks of the file only go from 0 to more while its inode is write locked, so they are read without a lock
+BLOCKTYPE getwriteblock(struct open_entry *entry, int i, int whole)
+{
+	struct blockmap *map = &bmaps[entry->inum];
+	int count = map->count;
+	BLOCKTYPE blk;
+
+	if (i < count && map->blocks[i] == 0)
+		return file_fillhole(entry, i);
+	if (i < count)
+		return refs[map->blocks[i]] ? file_unshare(entry, i, whole) : map->blocks[i];
+
+	// chain may only be extended from a block of its own
+	if (!(superblock->flags & MYFS_EXTENTS) && count > 0 && refs[map->blocks[count - 1]] &&
+	    file_unshare(entry, count - 1, 0) == 0)
+		return 0;
+
+	// first block of file has no predecessor, blocks skipped up to i are left as a hole
+	mutex_lock(alloc_lock);
+	blk = getnewblock(entry, map, i - count);
+	pthread_mutex_unlock(alloc_lock);
+	if (blk && count == 0)
+		entry->inode->start = blk;
+
+	// block map of this process is up to date, those of others are not
+	if (blk) {
+		file_gens[entry->inum]++;
+		bmap_gens[entry->inum]++;
+	}
+
+	return blk;
+}
+
+// appends a newly allocated block to file after a hole of gap blocks, holding allocation lock
+BLOCKTYPE getnewblock(struct open_entry *entry, struct blockmap *map, int gap)
+{
+	struct extlist *list = &extlists[entry->inum];
+	int extents = superblock->flags & MYFS_EXTENTS, count = map->count, res = 0;
+	BLOCKTYPE last = count ? map->blocks[count - 1] : 0;
+
+	// try to extend last extent, or run of chain
+	BLOCKTYPE blk = extents ? fat_alloc(last) : fat_setnext(last); // returns 0 if no space left
+	if (blk == 0)
+		return 0;
+
+	if (extents) {
+		// extents past those in extent table need an overflow block
+		ext_dirty[entry->inum] = 1;
+		if ((gap && ext_appendhole(list, gap, MAXEXTENTS(disk_blocksize))) ||
+		    ext_append(list, blk, MAXEXTENTS(disk_blocksize))) // too fragmented
+			res = -1;
+		else if (list->count > NDIRECTEXT && !list->overflow && (list->overflow = fat_alloc(0)) == 0)
+			res = -1;
+	} else {
+		fat_setgap(blk, gap);
+	}
+	for (int i = 0; !res && i <= gap; ++i)
+		res = bmap_append(map, i < gap ? 0 : blk);
+	if (!res)
+		return blk;
+
+	fat_dealloc(blk);
+	bmap_truncate(map, count);
+	if (extents) {
+		ext_truncate(list, count);
+		if (list->count <= NDIRECTEXT && list->overflow) {
+			fat_dealloc(list->overflow);
+			list->overflow = 0;
+		}
+	} else if (count) {
+		fat_setend(last);
+	}
+	return 0;
+}
+
+// gives open file a copy of its block i shared with clones, returns the copy, 0 if there is no space left
+// a FAT chain is shared from some block to its end, as every block has a single successor,
+// so the blocks of the file from the first one shared up to block i are copied together, holes between them skipped
+// blocks stay shared while they are copied, so that no other file writes them in place
+// holding write lock of inode
+BLOCKTYPE file_unshare(struct open_entry *entry, int i, int whole)
+{
+	struct blockmap *map = &bmaps[entry->inum];
+	int extents = superblock->flags & MYFS_EXTENTS;
+	int from = i, prev, next, n, j, k, res = 0;
+
+	mutex_lock(alloc_lock);
+	if (!refs[map->blocks[i]]) {
+		pthread_mutex_unlock(alloc_lock);
+		return map->blocks[i];
+	}
+	while (!extents && from > 0 && (map->blocks[from - 1] == 0 || refs[map->blocks[from - 1]]))
+		--from;
+	for (prev = from - 1; prev >= 0 && map->blocks[prev] == 0; --prev)
+		;
+	for (next = i + 1; next < map->count && map->blocks[next] == 0; ++next)
+		;
+	for (n = 0, k = from; k <= i; ++k)
+		n += map->blocks[k] != 0;
+
+	// at[j]: logical block of the j-th block copied
+	int *at = malloc(n * sizeof(int)), *old = malloc(n * sizeof(int)), *blks = calloc(n, sizeof(int));
+	for (j = 0, k = from; k <= i; ++k)
+		if (map->blocks[k])
+			at[j++] = k;
+	for (j = 0; j < n; ++j) {
+		old[j] = map->blocks[at[j]];
+		if ((blks[j] = fat_alloc(j ? blks[j - 1] : prev >= 0 ? map->blocks[prev] : 0)) == 0)
+			break;
+	}
+	pthread_mutex_unlock(alloc_lock);
+
+	if (j < n || copyblocks(old, blks, whole ? n - 1 : n))
+		res = -1;
+
+	mutex_lock(alloc_lock);
+	if (!res && extents) {
+		res = file_extset(entry, i, blks[0]);
+	} else if (!res) {
+		// copies take the place of the blocks in the chain, with the same holes before them, the rest of it is still shared
+		for (j = 0; j < n; ++j) {
+			fat_link(blks[j], j + 1 < n ? blks[j + 1] : next < map->count ? map->blocks[next] : (BLOCKTYPE) -1);
+			fat_setgap(blks[j], gaps[old[j]]);
+		}
+		if (prev >= 0)
+			fat_link(map->blocks[prev], blks[0]);
+		else
+			entry->inode->start = blks[0];
+	}
+	for (j = 0; j < n; ++j) {
+		if (res && blks[j])
+			fat_dealloc(blks[j]);
+		else if (!res)
+			fat_release(old[j]);
+	}
+	pthread_mutex_unlock(alloc_lock);
+
+	BLOCKTYPE blk = res ? 0 : blks[n - 1];
+	if (!res) {
+		for (j = 0; j < n; ++j)
+			map->blocks[at[j]] = blks[j];
+		file_gens[entry->inum]++;
+		bmap_gens[entry->inum]++;
+		STAT_ADD(cow_copies, n);
+	}
+	free(at);
+	free(old);
+	free(blks);
+	return blk;
+}
+
+// gives open file a newly allocated block for its block i, a hole, returns it, 0 if there is no space left
+// the hole is split around it in the chain, so the next block of the chain, whose gap changes, is unshared first
+// that block is found from the block before the hole, the block map ends with a block so there is one
+// holding write lock of inode
+BLOCKTYPE file_fillhole(struct open_entry *entry, int i)
+{
+	struct blockmap *map = &bmaps[entry->inum];
+	int extents = superblock->flags & MYFS_EXTENTS, prev, next = 0;
+	BLOCKTYPE nextblk = 0;
+
+	for (prev = i - 1; prev >= 0 && map->blocks[prev] == 0; --prev)
+		;
+	if (!extents) {
+		nextblk = prev >= 0 ? fat[map->blocks[prev]] : entry->inode->start;
+		next = prev + 1 + gaps[nextblk];
+		if (refs[nextblk] && (nextblk = file_unshare(entry, next, 0)) == 0)
+			return 0;
+	}
+
+	mutex_lock(alloc_lock);
+	BLOCKTYPE blk = fat_alloc(prev >= 0 ? map->blocks[prev] : 0); // returns 0 if no space left
+	if (blk && extents && file_extset(entry, i, blk)) {
+		fat_dealloc(blk);
+		blk = 0;
+	} else if (blk && !extents) {
+		fat_link(blk, nextblk);
+		fat_setgap(blk, i - prev - 1);
+		fat_setgap(nextblk, next - i - 1);
+		if (prev >= 0)
+			fat_link(map->blocks[prev], blk);
+		else
+			entry->inode->start = blk;
+	}
+	pthread_mutex_unlock(alloc_lock);
+	if (blk) {
+		map->blocks[i] = blk;
+		file_gens[entry->inum]++;
+		bmap_gens[entry->inum]++;
+	}
+	return blk;
+}
+
+// puts blk in place of block i of extent list of open file, a hole or a shared block, holding allocation lock
+int file_extset(struct open_entry *entry, int i, BLOCKTYPE blk)
+{
+	struct extlist *list = &extlists[entry->inum];
+	BLOCKTYPE overflow = list->overflow;
+	int res = 0;
+
+	// extent list may need an overflow block once split
+	if (!list->overflow && list->count + 2 > NDIRECTEXT && (list->overflow = fat_alloc(0)) == 0)
+		res = -1;
+	else if (ext_replace(list, i, blk, MAXEXTENTS(disk_blocksize)))
+		res = -1;
+	if (list->overflow != overflow && (res || list->count <= NDIRECTEXT)) {
+		if (list->overflow)
+			fat_dealloc(list->overflow);
+		list->overflow = overflow;
+	}
+	ext_dirty[entry->inum] = 1;
+	return res;
+}
+
+int myfs_write(int fd, void *buf, int n)
+{
+	int bytes_written = -1;
+
+	// check if file open
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return bytes_written;
+
+	// blocks freed since last commit may only be allocated once it is written
+	bytes_written = entry_write(entry, buf, n);
+	if (bytes_written >= 0 && bytes_written < n && log_freespace()) {
+		int more = entry_write(entry, (char *) buf + bytes_written, n - bytes_written);
+		if (more > 0)
+			bytes_written += more;
+	}
+	pthread_mutex_unlock(&entry->lock);
+	return bytes_written;
+}
+
+// writes to open entry, holding its lock
+int entry_write(struct open_entry *entry, void *buf, int n)
+{
+	int bytes_written = -1;
+
+	op_begin();
+	if (inode_wrlock(entry->inum) == 0) {
+		bytes_written = file_write(entry, buf, n);
+
+		// other processes cannot flush write buffer of entry, it is flushed before they may read the file
+		if ((mount_opts & MYFS_SHARED) && wb_flush(entry))
+			bytes_written = -1;
+		rwlock_unlock(&inode_locks[entry->inum]);
+	}
+	op_end();
+	return bytes_written;
+}
+
+// writes to open entry, holding its lock and write lock of its inode
+int file_write(struct open_entry *entry, void *buf, int n)
+{
+	int bytes_written = -1;
+	int i, k, siz;
+
+	if (n < 0 || (entry->offset + n) / disk_blocksize >= MAXFILEBLOCKS)
+		return bytes_written;
+
+	// same as read, instead if offset == size and bytes_written < n,
+	// increment size and if necessary allocate new block on fat
+	// runs of full blocks are written directly from buf, without reading them first
+	// holes are given blocks as they are written, a write past end of file leaves a hole up to it
+	int *blks = NULL;
+
+	// other entries may be buffering the same blocks
+	if (wb_pending[entry->inum] > (entry->wblk != -1) && wb_flushfile(entry->inum, entry))
+		return bytes_written;
+	if (entry->offset > entry->inode->size && file_zerotail(entry))
+		return bytes_written;
+
+	bytes_written = 0;
+	while (bytes_written < n) {
+		int blk = entry->offset / disk_blocksize;
+
+		if (entry->offset % disk_blocksize == 0 && n - bytes_written >= disk_blocksize) {
+			// full blocks, allocated as necessary
+			k = (n - bytes_written) / disk_blocksize;
+			if (blks == NULL)
+				blks = malloc(k * sizeof(int));
+			for (i = 0; i < k; ++i)
+				if ((blks[i] = getwriteblock(entry, blk + i, 1)) == 0) // returns 0 if no space left
+					break;
+			if ((k = i) == 0 || writeblocks(blks, k, buf + bytes_written))
+				break;
+			siz = k * disk_blocksize;
+			if (entry->wblk >= blk && entry->wblk < blk + k) { // overwritten
+				entry->wblk = -1;
+				wb_pending[entry->inum]--;
+			}
+		} else if (disk_map) {
+			// partial block, written to in place, a new one for a hole is zeroed around what is written
+			char *blockbuf;
+			int fresh = bmap_get(&bmaps[entry->inum], blk) == 0;
+			int b = getwriteblock(entry, blk, 0);
+			if (b == 0 || (blockbuf = loadblock(b, NULL)) == NULL)
+				break;
+			if (fresh)
+				memset(blockbuf, 0, disk_blocksize);
+
+			siz = n - bytes_written;
+			if (siz > disk_blocksize - entry->offset % disk_blocksize) // will reach end of block
+				siz = disk_blocksize - entry->offset % disk_blocksize;
+			memcpy(blockbuf + entry->offset % disk_blocksize, buf + bytes_written, siz);
+			if (writeblock(b, blockbuf))
+				break;
+		} else {
+			// partial block, gathered in write buffer of entry
+			if (entry->wblk != blk) {
+				int fresh = bmap_get(&bmaps[entry->inum], blk) == 0;
+				int b = getwriteblock(entry, blk, 0);
+				if (b == 0 || wb_flush(entry))
+					break;
+				if (entry->wbuf == NULL && (entry->wbuf = malloc(disk_blocksize)) == NULL)
+					break;
+
+				// nothing to read if block is newly allocated, or starts at or after end of file
+				if (fresh || (int64_t) blk * disk_blocksize >= entry->inode->size)
+					memset(entry->wbuf, 0, disk_blocksize);
+				else if (cache_read(cache, b, entry->wbuf))
+					break;
+				entry->wblk = blk;
+				wb_pending[entry->inum]++;
+			}
+
+			siz = n - bytes_written;
+			if (siz > disk_blocksize - entry->offset % disk_blocksize) // will reach end of block
+				siz = disk_blocksize - entry->offset % disk_blocksize;
+			memcpy(entry->wbuf + entry->offset % disk_blocksize, buf + bytes_written, siz);
+		}
+
+		bytes_written += siz;
+		entry->offset += siz;
+		if (entry->offset >= entry->inode->size)
+			entry->inode->size = entry->offset;
+
+		// printf("written %d bytes, offset %d, block %d, size %d\n", siz, entry->offset, entry->curr, entry->inode->size);
+	}
+	entry->curr = bmap_get(&bmaps[entry->inum], entry->offset / disk_blocksize);
+
+	// cursor left buffered block
+	if (entry->wblk != -1 && entry->wblk != entry->offset / disk_blocksize && wb_flush(entry))
+		bytes_written = bytes_written ?: -1;
+
+	free(blks);
+	return (bytes_written);
+}
+
+int myfs_truncate(int fd, int64_t size)
+{
+	// compare size with current size
+	// look up last block within size in block map
+	// deallocate every block after it in order on fat
+	// on last block, just change file size to size
+
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return -1;
+
+	int ret = -1;
+	op_begin();
+	if (inode_wrlock(entry->inum) == 0) {
+		ret = file_truncate(entry, size);
+		rwlock_unlock(&inode_locks[entry->inum]);
+	}
+	op_end();
+	pthread_mutex_unlock(&entry->lock);
+	return ret;
+}
+
+// zeroes the rest of the last block of open file past its end, before the file is extended past it
+// the block may still hold what was there before the file was last truncated, or before the block was allocated
+// holding entry lock and write lock of its inode
+int file_zerotail(struct open_entry *entry)
+{
+	int64_t size = entry->inode->size, offset = entry->offset;
+	int n = (disk_blocksize - size % disk_blocksize) % disk_blocksize;
+
+	if (n == 0 || bmap_get(&bmaps[entry->inum], size / disk_blocksize) == 0)
+		return 0;
+
+	char *zeros = calloc(1, n);
+	entry->offset = size;
+	int res = file_write(entry, zeros, n) == n ? 0 : -1;
+	entry->offset = offset;
+	entry->inode->size = size;
+	free(zeros);
+	return res;
+}
+
+// shrinks or extends file of open entry, holding its lock and write lock of its inode
+// extending it leaves a hole up to its new end, without allocating any block
+int file_truncate(struct open_entry *entry, int64_t size)
+{
+	if (size < 0 || size / disk_blocksize >= MAXFILEBLOCKS)
+		return -1;
+	if (size >= entry->inode->size) {
+		if (size > entry->inode->size && file_zerotail(entry))
+			return -1;
+		entry->inode->size = size;
+		return 0;
+	}
+	if (wb_flushfile(entry->inum, NULL))
+		return -1;
+
+	// blocks needed to hold size bytes, a hole before them needs none
+	struct blockmap *map = &bmaps[entry->inum];
+	int keep = (size + disk_blocksize - 1) / disk_blocksize;
+	if (keep > map->count)
+		keep = map->count;
+	while (keep > 0 && map->blocks[keep - 1] == 0)
+		--keep;
+
+	// chain may only be cut at a block of its own
+	if (!(superblock->flags & MYFS_EXTENTS) && keep > 0 && keep < map->count && refs[map->blocks[keep - 1]] &&
+	    file_unshare(entry, keep - 1, 0) == 0)
+		return -1;
+
+	// deallocate every block after those, unless other files hold them
+	mutex_lock(alloc_lock);
+	if (fat_releaseblocks(map->blocks + keep, map->count - keep)) {
+		pthread_mutex_unlock(alloc_lock);
+		return -1;
+	}
+	if (superblock->flags & MYFS_EXTENTS) {
+		struct extlist *list = &extlists[entry->inum];
+		ext_truncate(list, keep);
+		if (list->count <= NDIRECTEXT && list->overflow) {
+			fat_dealloc(list->overflow);
+			list->overflow = 0;
+		}
+		ext_dirty[entry->inum] = 1;
+	} else if (keep > 0 && keep < map->count)
+		fat_setend(map->blocks[keep - 1]);
+	pthread_mutex_unlock(alloc_lock);
+	if (keep == 0)
+		entry->inode->start = 0;
+	bmap_truncate(map, keep);
+	file_gens[entry->inum]++;
+	bmap_gens[entry->inum]++;
+
+	// open entries of file may be past its end
+	entry->inode->size = size;
+	open_fixup(entry->inum);
+
+	return (0);
+}
+
+/* write data and metadata of open file to disk */
+int myfs_fsync(int fd)
+{
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return -1;
+
+	int res = -1;
+	if (inode_wrlock(entry->inum) == 0) {
+		res = file_sync(entry->inum);
+		rwlock_unlock(&inode_locks[entry->inum]);
+	}
+	pthread_mutex_unlock(&entry->lock);
+
+	// size and blocks of file are committed along with whatever other metadata changed, which is little
+	// only metadata blocks are written back besides those of file, and the fdatasync of the commit makes them durable
+	return res ?: log_commit(1, 0);
+}
+
+// writes blocks of file held in write buffers and the cache into the disk file, without waiting for the device
+// holding write lock of its inode
+int file_sync(int inum)
+{
+	struct blockmap *map = &bmaps[inum];
+
+	if (wb_flushfile(inum, NULL))
+		return -1;
+	// only blocks of file are written back and their writeback started, the commit following makes them durable
+	if (!disk_map && cache_flushblocks(cache, (int *) map->blocks, map->count)) // holes map to block 0, never cached
+		return -1;
+	return disk_map ? 0 : disk_startsync((int *) map->blocks, map->count);
+}
+
+/* write data and metadata of every file to disk */
+int myfs_sync()
+{
+	int res = 0;
+
+	// write buffers of files open in process, then every dirty block in the cache
+	// buffers are only left after a write in private mounts, where block maps are always up to date
+	for (int inum = 0; inum < disk_maxfiles; ++inum) {
+		rwlock_wrlock(&inode_locks[inum]);
+		if (wb_pending[inum] && wb_flushfile(inum, NULL))
+			res = -1;
+		rwlock_unlock(&inode_locks[inum]);
+	}
+	if (!disk_map && cache_flush(cache))
+		res = -1;
+
+	return log_commit(1, 1) || res ? -1 : 0;
+}
+
+/* copy file src into file dst, created if it does not exist */
+int myfs_copy(char *src, char *dst)
+{
+	int from = myfs_open(src), to = -1;
+	if (from == -1)
+		return -1;
+	if ((to = myfs_open(dst)) == -1)
+		to = myfs_create(dst);
+	if (to == -1) {
+		myfs_close(from);
+		return -1;
+	}
+
+	struct open_entry *in = entry_lock(from), *out = in ? entry_lock(to) : NULL;
+	int64_t res = -1;
+	if (out && in->inum != out->inum) {
+		// inodes locked in order of their numbers
+		int locked = 0;
+		op_begin();
+		if (in->inum < out->inum && inode_rdlock(in->inum) == 0) {
+			if (!(locked = inode_wrlock(out->inum) == 0))
+				rwlock_unlock(&inode_locks[in->inum]);
+		} else if (in->inum > out->inum && inode_wrlock(out->inum) == 0) {
+			if (!(locked = inode_rdlock(in->inum) == 0))
+				rwlock_unlock(&inode_locks[out->inum]);
+		}
+		if (locked) {
+			// runs of source blocks go straight into blocks of destination, both within the disk file
+			// holes are skipped, destination gets the same holes
+			in->offset = out->offset = 0;
+			res = file_truncate(out, 0);
+			while (res == 0 && in->offset < in->inode->size) {
+				off_t pos;
+				int64_t len = file_run(in, &pos);
+				if (len <= 0 || (pos != -1 && file_import(out, disk_fd, &pos, len) != len))
+					res = -1;
+				else if (pos == -1)
+					out->offset += len;
+				in->offset += len;
+			}
+			if (res == 0)
+				res = file_truncate(out, in->inode->size);
+			in->curr = bmap_get(&bmaps[in->inum], in->offset / disk_blocksize);
+			rwlock_unlock(&inode_locks[in->inum]);
+			rwlock_unlock(&inode_locks[out->inum]);
+		}
+		op_end();
+	}
+	if (out)
+		pthread_mutex_unlock(&out->lock);
+	if (in)
+		pthread_mutex_unlock(&in->lock);
+
+	if (myfs_close(to) || myfs_close(from))
+		res = -1;
+	return res;
+}
+
+/* create file dst sharing the blocks of file src, until either writes to them */
+int myfs_clone(char *src, char *dst)
+{
+	int fd = myfs_open(src);
+	if (fd == -1)
+		return -1;
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL) {
+		myfs_close(fd);
+		return -1;
+	}
+
+	struct blockmap *map = &bmaps[entry->inum];
+	struct inode inode;
+	int res = -1, i = 0;
+
+	// new file may not be opened before it holds the blocks, nor src be written meanwhile
+	op_begin();
+	rwlock_wrlock(dir_lock);
+	int k = dir_add(dir, dst), inum = k == -1 ? -1 : dir->entries[k].inum;
+	STAT_ADD(dir_lookups, 1);
+	if (inum != -1 && inode_wrlock(entry->inum) == 0) {
+		// buffered blocks are written back while still private
+		if (wb_flushfile(entry->inum, NULL) == 0) {
+			mutex_lock(alloc_lock);
+			for (i = 0; i < map->count; ++i)
+				if (map->blocks[i] && fat_share(map->blocks[i]))
+					break;
+			res = i < map->count ? -1 : 0;
+
+			// clone gets an extent list of its own, a FAT chain is shared as it is
+			struct extlist *list = &extlists[inum];
+			ext_dirty[inum] = 1;
+			if (!res && (superblock->flags & MYFS_EXTENTS)) {
+				ext_copy(list, &extlists[entry->inum]);
+				if (list->overflow && (list->overflow = fat_alloc(0)) == 0) {
+					ext_truncate(list, 0);
+					res = -1;
+				}
+			}
+			while (res && i > 0)
+				if (map->blocks[--i])
+					fat_release(map->blocks[i]);
+			pthread_mutex_unlock(alloc_lock);
+			if (!res)
+				dir->fcbs[inum].inode = *entry->inode;
+		}
+		rwlock_unlock(&inode_locks[entry->inum]);
+	}
+	if (res && inum != -1)
+		dir_remove(dir, dst, &inode);
+	rwlock_unlock(dir_lock);
+	op_end();
+	pthread_mutex_unlock(&entry->lock);
+
+	if (myfs_close(fd))
+		res = -1;
+	return res;
+}
+
+/* copy open file from its offset to its end into host_fd, at its file offset */
+int64_t myfs_export(int fd, int host_fd)
+{
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return -1;
+
+	// holes are written as zeros, host_fd may not be seekable
+	int64_t copied = -1;
+	char *zeros = NULL;
+	if (inode_rdlock(entry->inum) == 0) {
+		copied = 0;
+		while (entry->offset < entry->inode->size) {
+			off_t pos;
+			int64_t len = file_run(entry, &pos), n = -1;
+			if (len > 0 && pos == -1) {
+				// written a block at a time
+				if (len > disk_blocksize)
+					len = disk_blocksize;
+				if (zeros || (zeros = calloc(1, disk_blocksize)))
+					n = write(host_fd, zeros, len);
+			} else if (len > 0) {
+				n = host_copy(disk_fd, &pos, host_fd, NULL, len);
+				if (n > 0)
+					stat_io(0, (n + disk_blocksize - 1) / disk_blocksize);
+			}
+			if (len <= 0 || n <= 0) {
+				copied = copied ?: -1;
 				break;
-			if (entry->offset == entry->inode->size)
-				entry->curr = fat_setnext(entry->curr); // returns 0 if no space left
+			}
+			copied += n;
+			entry->offset += n;
+			if (n < len)
+				break;
+		}
+		entry->curr = bmap_get(&bmaps[entry->inum], entry->offset / disk_blocksize);
+		rwlock_unlock(&inode_locks[entry->inum]);
+	}
+	pthread_mutex_unlock(&entry->lock);
+	free(zeros);
+	return copied;
+}
+
+/* copy host_fd from its file offset to its end into open file, at its offset */
+int64_t myfs_import(int fd, int host_fd)
+{
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return -1;
+
+	// length of regular files is known, pipes and sockets are copied until they are closed
+	struct stat st;
+	int64_t len = -1, copied = 0, n = -1;
+	off_t at = lseek(host_fd, 0, SEEK_CUR);
+	if (fstat(host_fd, &st) == 0 && S_ISREG(st.st_mode) && at != -1)
+		len = st.st_size > at ? st.st_size - at : 0;
+
+	// retried once if out of space, see myfs_write
+	for (int retry = 0; ; retry = 1) {
+		n = -1;
+		op_begin();
+		if (inode_wrlock(entry->inum) == 0) {
+			n = file_import(entry, host_fd, NULL, len == -1 ? -1 : len - copied);
+			rwlock_unlock(&inode_locks[entry->inum]);
+		}
+		op_end();
+		if (n > 0)
+			copied += n;
+		if (n < 0 || (len != -1 && copied == len) || retry || !log_freespace())
+			break;
+	}
+	pthread_mutex_unlock(&entry->lock);
+	return copied ?: n;
+}
+
+// counters of stats are the uint64_t fields before open_files
+#define NCOUNTERS (offsetof(struct myfs_stats, open_files) / sizeof(uint64_t))
+
+int myfs_stats(struct myfs_stats *stats)
+{
+	if (disk_fd == 0)
+		return -1;
+
+	memset(stats, 0, sizeof(struct myfs_stats));
+	for (size_t i = 0; i < NCOUNTERS; ++i)
+		((uint64_t *) stats)[i] = __atomic_load_n(&((uint64_t *) &shared->stats)[i], __ATOMIC_RELAXED);
+
+	mutex_lock(alloc_lock);
+	stats->alloc_probes = freemap->probes;
+	stats->saved_blocks = shared->saved_blocks;
+	pthread_mutex_unlock(alloc_lock);
+	if (!disk_map) {
+		mutex_lock(&cache->lock);
+		stats->cache_hits = cache->hits;
+		stats->cache_misses = cache->misses;
+		stats->cache_writebacks = cache->writebacks;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	mutex_lock(open_lock);
+	stats->open_files = opentable->filenum;
+	stats->open_max = open_max;
+	pthread_mutex_unlock(open_lock);
+	return 0;
+}
+
+// counters of every process start over, the most open files of this process start from those open now
+int myfs_stats_reset()
+{
+	if (disk_fd == 0)
+		return -1;
+
+	for (size_t i = 0; i < NCOUNTERS; ++i)
+		__atomic_store_n(&((uint64_t *) &shared->stats)[i], 0, __ATOMIC_RELAXED);
+
+	mutex_lock(alloc_lock);
+	freemap->probes = 0;
+	pthread_mutex_unlock(alloc_lock);
+	if (!disk_map) {
+		mutex_lock(&cache->lock);
+		cache->hits = cache->misses = cache->writebacks = 0;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	mutex_lock(open_lock);
+	open_max = opentable->filenum;
+	pthread_mutex_unlock(open_lock);
+	return 0;
+}
+
+
+int64_t myfs_seek(int fd, int64_t offset)
+{
+	int64_t position = -1;
+
+	// look up block map
+	struct open_entry *entry = entry_lock(fd);
+	if (entry == NULL)
+		return position;
+
+	// flushing a buffered block needs the write lock
+	struct rwlock *lock = &inode_locks[entry->inum];
+	if ((entry->wblk != -1 ? inode_wrlock(entry->inum) : inode_rdlock(entry->inum)) != 0) {
+		pthread_mutex_unlock(&entry->lock);
+		return position;
+	}
+
+	// offset may be past end of file, a write there leaves a hole up to it
+	if (offset >= 0 && offset / disk_blocksize < MAXFILEBLOCKS && wb_flush(entry) == 0) {
+		position = offset;
+		entry->curr = bmap_get(&bmaps[entry->inum], position / disk_blocksize);
+		entry->offset = position;
+	}
+	rwlock_unlock(lock);
+	pthread_mutex_unlock(&entry->lock);
+
+	return (position);
+}
+
+int64_t myfs_filesize (int fd)
+{
+	int64_t size = -1;
+
+	// retrieve open table entry
+	struct open_entry *entry = entry_lock(fd);
+
+	if (entry == NULL)
+		return size;
+	rwlock_rdlock(&inode_locks[entry->inum]);
+	size = entry->inode->size;
+	rwlock_unlock(&inode_locks[entry->inum]);
+	pthread_mutex_unlock(&entry->lock);
+
+	return (size);
+}
+
+
+void myfs_print_dir ()
+{
+	// entries are unordered, sort them first
+	int *order = malloc(disk_maxfiles * sizeof(int));
+	rwlock_rdlock(dir_lock);
+	dir_sorted(dir, order);
+	for (int i = 0; i < dir->hdr->filenum; ++i)
+		printf("%s\n", dir->entries[order[i]].filename);
+	rwlock_unlock(dir_lock);
+	free(order);
+}
+
+
+void myfs_print_blocks (char *  filename)
+{
+	// find filename on dir
+	// for each file, traverse fat from their start
+	rwlock_rdlock(dir_lock);
+	int inum = dir_get(dir, filename);
+	STAT_ADD(dir_lookups, 1);
+
+	if (inum == -1) {
+		rwlock_unlock(dir_lock);
+		printf("Error: file %s does not exist.\n", filename);
+		return;
+	}
+
+	struct blockmap map;
+	rwlock_rdlock(&inode_locks[inum]);
+	int res = bmap_build(inum, &map);
+	rwlock_unlock(&inode_locks[inum]);
+	rwlock_unlock(dir_lock);
+	if (res)
+		return;
+
+	printf("%s:", filename);
+	for (int i = 0; i < map.count; ++i)
+		if (map.blocks[i])
+			printf(" %d", map.blocks[i]);
+		else
+			printf(" -"); // hole
+	bmap_free(&map);
+	putchar('\n');
+}
+
+// Block maps
+
+// builds block map of inum from its extents, or by following its chain
+int bmap_build(int inum, struct blockmap *map)
+{
+	struct inode *inode = &dir->fcbs[inum].inode;
+	BLOCKTYPE blk = inode->start;
+
+	bmap_init(map);
+
+	if (superblock->flags & MYFS_EXTENTS) {
+		struct extlist *list = &extlists[inum];
+		for (int i = 0; i < list->count; ++i) {
+			for (BLOCKTYPE j = 0; j < list->ext[i].len; ++j) {
+				if (bmap_append(map, list->ext[i].start ? list->ext[i].start + j : 0)) {
+					bmap_free(map);
+					return -1;
+				}
+			}
+		}
+		return 0;
+	}
+
+	// an empty file owns no blocks, even if start was left over
+	if (inode->size == 0) {
+		if (inode->start)
+			inode->start = 0;
+		return 0;
+	}
+
+	// chain may include one preallocated block past end of file, holes before a block are mapped to 0
+	for (int n = 0; blk >= DATASTART && blk < disk_blockcount && n < disk_blockcount; ++n) {
+		for (uint32_t j = 0; j <= gaps[blk]; ++j) {
+			if (bmap_append(map, j < gaps[blk] ? 0 : blk)) {
+				bmap_free(map);
+				return -1;
+			}
+		}
+		blk = fat_getnext(blk);
+	}
+
+	return 0;
+}
+
+// rebuilds block map of inum after another process changed blocks of the file, holding write lock of inum
+int bmap_refresh(int inum)
+{
+	bmap_free(&bmaps[inum]);
+	if (bmap_build(inum, &bmaps[inum]))
+		return -1;
+	bmap_gens[inum] = file_gens[inum];
+	open_fixup(inum);
+	return 0;
+}
+
+// looks up current blocks of open entries of inum again, entries past end of file stay there
+void open_fixup(int inum)
+{
+	mutex_lock(open_lock);
+	for (int i = 0; i < MAXOPENFILES; ++i) {
+		struct open_entry *entry = open_get(opentable, i);
+		if (entry && entry->inum == inum)
+			entry->curr = bmap_get(&bmaps[inum], entry->offset / disk_blocksize);
+	}
+	pthread_mutex_unlock(open_lock);
+}
+
+// Extent table
+
+// loads extent lists of every valid file into segment, reading overflow blocks as necessary
+int ext_load()
+{
+	struct extent_entry *table = malloc((size_t) EXTSIZE * disk_blocksize);
+	struct extent *overflow = malloc(disk_blocksize);
+	int *blks = malloc(EXTSIZE * sizeof(int));
+	int blk, res = 0;
+
+	for (int i = 0; i < EXTSIZE; ++i)
+		blks[i] = EXTBLOCK + i;
+	res = readblocks(blks, EXTSIZE, table);
+	free(blks);
+	if (res) {
+		free(table);
+		free(overflow);
+		return -1;
+	}
+
+	// every file has room for as many extents as it may have in segment, files created later included
+	int max = MAXEXTENTS(disk_blocksize);
+	for (int inum = 0; inum < disk_maxfiles && !res; ++inum) {
+		struct extlist *list = &extlists[inum];
+		struct extent_entry *e = &table[inum];
+
+		ext_attach(list, shared->extents + (size_t) inum * max, max);
+		ext_attach(&shared->ext_shadow[inum], shared->shadow_extents + (size_t) inum * max, max);
+		if (!dir->fcbs[inum].valid)
+			continue;
+		if (e->count > (uint32_t) max) {
+			res = -1;
+			break;
+		}
+
+		list->overflow = e->overflow;
+		list->count = e->count;
+		memcpy(list->ext, e->ext, (e->count < NDIRECTEXT ? e->count : NDIRECTEXT) * sizeof(struct extent));
+
+		if (e->count > NDIRECTEXT) {
+			blk = e->overflow;
+			if (readblocks(&blk, 1, overflow))
+				res = -1;
 			else
-				entry->curr = fat_getnext(entry->curr);
-			// printf("next block %d\n", entry->curr);
-			if (entry->curr == 0 || getblock(entry->curr, blockbuf))
+				memcpy(list->ext + NDIRECTEXT, overflow, (e->count - NDIRECTEXT) * sizeof(struct extent));
+		}
+	}
+
+	free(table);
+	free(overflow);
+	return res;
+}
+
+// writes extent lists as of last commit into extent table, and overflow blocks of files logged since last checkpoint
+// overflow blocks are allocated and freed along with the extents that need them
+int ext_store()
+{
+	struct extent_entry *table = calloc(EXTSIZE, disk_blocksize);
+	struct extent *overflow = malloc(disk_blocksize);
+	char *changed = calloc(EXTSIZE, 1);
+	int perblock = disk_blocksize / sizeof(struct extent_entry), res = 0;
+
+	for (int inum = 0; inum < disk_maxfiles && !res; ++inum) {
+		struct extlist *list = &shared->ext_shadow[inum];
+		struct extent_entry *e = &table[inum];
+
+		e->overflow = list->overflow;
+		e->count = list->count;
+		memcpy(e->ext, list->ext, (list->count < NDIRECTEXT ? list->count : NDIRECTEXT) * sizeof(struct extent));
+		if (!shared->ext_logged[inum])
+			continue;
+
+		if (list->count > NDIRECTEXT) {
+			memset(overflow, 0, disk_blocksize);
+			memcpy(overflow, list->ext + NDIRECTEXT, (list->count - NDIRECTEXT) * sizeof(struct extent));
+			if (writeblock(list->overflow, overflow))
+				res = -1;
+		}
+		changed[inum / perblock] = 1;
+		shared->ext_logged[inum] = 0;
+	}
+
+	for (int i = 0; i < EXTSIZE && !res; ++i)
+		if (changed[i] && writeblock(EXTBLOCK + i, (char *) table + (size_t) i * disk_blocksize))
+			res = -1;
+
+	free(table);
+	free(overflow);
+	free(changed);
+	return res;
+}
+
+// Copying
+
+// copies up to len bytes between host descriptors with copy_file_range, which the kernel may do without
+// moving them at all, or with splice where it does not apply; returns bytes copied, less at end of in_fd
+int64_t host_copy(int in_fd, off_t *off_in, int out_fd, off_t *off_out, int64_t len)
+{
+	int64_t done = 0;
+	ssize_t n = 0;
+
+	while (done < len) {
+		n = copy_file_range(in_fd, off_in, out_fd, off_out, len - done, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+			// pipes, sockets and file systems not supporting it
+			n = host_splice(in_fd, off_in, out_fd, off_out, len - done);
+			if (n > 0)
+				done += n;
+			break;
+		}
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	return done ?: n < 0 ? -1 : 0;
+}
+
+// moves up to len bytes with splice, through a pipe unless either end is one
+int64_t host_splice(int in_fd, off_t *off_in, int out_fd, off_t *off_out, int64_t len)
+{
+	struct stat st;
+	int direct = (fstat(in_fd, &st) == 0 && S_ISFIFO(st.st_mode)) || (fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode));
+	int p[2];
+	int64_t done = 0;
+	ssize_t n = 0, m;
+
+	if (!direct && pipe(p))
+		return -1;
+	if (!direct)
+		fcntl(p[1], F_SETPIPE_SZ, COPYRUN * disk_blocksize); // capacity stays as is if not allowed
+
+	while (done < len) {
+		if (direct) {
+			n = splice(in_fd, off_in, out_fd, off_out, len - done, SPLICE_F_MOVE);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			done += n;
+			continue;
+		}
+
+		n = splice(in_fd, off_in, p[1], NULL, len - done, SPLICE_F_MOVE);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		// what is in the pipe is lost if it cannot be written
+		for (m = n; m > 0; m -= n) {
+			n = splice(p[0], NULL, out_fd, off_out, m, SPLICE_F_MOVE);
+			if (n == -1 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				break;
+			done += n;
+		}
+		if (m > 0) {
+			n = -1;
+			break;
+		}
+	}
+
+	if (!direct) {
+		close(p[0]);
+		close(p[1]);
+	}
+	return done ?: n < 0 ? -1 : 0;
+}
+
+// copies len bytes of in_fd at *off, or at its file offset if off is NULL, into open entry at its offset
+// they go straight into blocks of the disk file, allocated in runs; len -1 copies until end of in_fd
+// holding entry lock and write lock of its inode
+int64_t file_import(struct open_entry *entry, int in_fd, off_t *off, int64_t len)
+{
+	struct blockmap *map = &bmaps[entry->inum];
+	int64_t copied = 0, n = 0;
+	int blks[COPYRUN];
+
+	// buffered blocks and cached ones would hide what is copied under them
+	if (len < -1 || wb_flushfile(entry->inum, NULL))
+		return -1;
+	if (entry->offset > entry->inode->size && file_zerotail(entry))
+		return -1;
+
+	// a block allocated for a hole, but left for the next run, is still to be zeroed
+	int carry = 0;
+	while (len == -1 || copied < len) {
+		int blk = entry->offset / disk_blocksize, i, k;
+		int64_t siz = len == -1 ? (int64_t) COPYRUN * disk_blocksize : len - copied;
+		if ((entry->offset + siz) / disk_blocksize >= MAXFILEBLOCKS)
+			break;
+
+		// blocks spanned, up to the first one not following the one before on disk, which starts the next run
+		k = (entry->offset % disk_blocksize + siz + disk_blocksize - 1) / disk_blocksize;
+		if (k > COPYRUN)
+			k = COPYRUN;
+		int first = carry || bmap_get(map, blk) == 0, last = first;
+		carry = 0;
+		for (i = 0; i < k; ++i) {
+			int hole = i ? bmap_get(map, blk + i) == 0 : first;
+			if ((blks[i] = getwriteblock(entry, blk + i, 0)) == 0)
+				break;
+			if (i && blks[i] != blks[i - 1] + 1) {
+				carry = hole;
 				break;
+			}
+			last = hole;
+		}
+		if (i == 0)
+			break;
+		if ((int64_t) (blk + i) * disk_blocksize - entry->offset < siz)
+			siz = (int64_t) (blk + i) * disk_blocksize - entry->offset;
+		if (!disk_map && cache_drop(cache, blks, i))
+			break;
+
+		// new blocks for holes are zeroed where they are not copied over, around the cache as well
+		int head = entry->offset % disk_blocksize, tail = (entry->offset + siz) % disk_blocksize;
+		if (first && head && zeroblocks(blks[0], 1))
+			break;
+		if (last && tail && (i > 1 || !head) && zeroblocks(blks[i - 1], 1))
+			break;
+
+		off_t pos = (off_t) blks[0] * disk_blocksize + entry->offset % disk_blocksize;
+		if ((n = host_copy(in_fd, off, disk_fd, &pos, siz)) <= 0)
+			break;
+		stat_io(1, i);
+		if (disk_map)
+			memset(map_dirty + blks[0], 1, i);
+
+		copied += n;
+		entry->offset += n;
+		if (entry->offset > entry->inode->size)
+			entry->inode->size = entry->offset;
+		if (n < siz)
+			break;
+	}
+	entry->curr = bmap_get(map, entry->offset / disk_blocksize);
+
+	// blocks allocated past what was copied are given back
+	int64_t size = entry->inode->size;
+	if (map->count > (size + disk_blocksize - 1) / disk_blocksize) {
+		entry->inode->size = (int64_t) map->count * disk_blocksize;
+		if (file_truncate(entry, size))
+			return -1;
+	}
+
+	return copied ?: n < 0 ? -1 : 0;
+}
+
+// returns length of run of consecutive blocks of open entry from its offset up to its end, at most COPYRUN blocks,
+// and sets *pos to where it starts in the disk file, once blocks of the run in the cache are written back
+// a run of holes, blocks past the end of the chain included, has no blocks and sets *pos to -1
+// holding entry lock and a lock of its inode
+int64_t file_run(struct open_entry *entry, off_t *pos)
+{
+	struct blockmap *map = &bmaps[entry->inum];
+	int blk = entry->offset / disk_blocksize, k;
+	int blks[COPYRUN];
+
+	if (entry->offset >= entry->inode->size)
+		return -1;
+	if (bmap_get(map, blk) == 0) {
+		for (k = 1; k < COPYRUN && bmap_get(map, blk + k) == 0; ++k)
+			;
+	} else {
+		for (k = 1; k < COPYRUN && blk + k < map->count && map->blocks[blk + k] == map->blocks[blk + k - 1] + 1; ++k)
+			;
+	}
+
+	int64_t len = (int64_t) (blk + k) * disk_blocksize - entry->offset;
+	if (len > entry->inode->size - entry->offset)
+		len = entry->inode->size - entry->offset;
+	if (bmap_get(map, blk) == 0) {
+		*pos = -1;
+		return len;
+	}
+	k = (entry->offset % disk_blocksize + len + disk_blocksize - 1) / disk_blocksize;
+	for (int i = 0; i < k; ++i)
+		blks[i] = map->blocks[blk + i];
+	if (!disk_map && cache_flushblocks(cache, blks, k))
+		return -1;
+
+	*pos = (off_t) blks[0] * disk_blocksize + entry->offset % disk_blocksize;
+	return len;
+}
+
+// Consistency check
+
+// state of myfs_check, shared by its threads
+// files first claim every block their chain or extents reach, then keep the blocks they claimed
+// up to the first one they may not keep; a block reached by several files goes to the one holding it
+// within its size, the one of lowest number among those
+// blocks with a reference count are shared by clones instead, kept by every file reaching them and counted
+// holes take no block, but count towards the logical block a block of the file is at
+struct check_file {
+	int count;       // blocks kept
+	int64_t span;    // logical blocks up to the last block kept, holes included
+	int within;      // blocks kept within size
+	BLOCKTYPE last;  // last block kept, if any
+	int crosslinked; // reached a block claimed by another file, or a block it had already kept
+	int invalid;     // reached a block outside data region
+	int unallocated; // blocks kept that are free in FAT
+	int overflow;    // overflow block of extent list may not be kept
+};
+
+struct {
+	uint32_t *owner; // claim of file taking each block, 0 if none
+	char *seen;      // blocks kept, each set only by the file claiming it, or by every file sharing it
+	uint32_t *holders; // files keeping each shared block
+	struct check_file *files;
+	int nthreads;
+	int *leaked;     // count of each thread
+	int *badrefs;    // count of each thread
+} chk;
+
+// claim of file inum on its block i, lower claims win, blocks past end of file lose to any other
+#define CLAIM(inum, i, need) ((uint32_t) (inum) + 1 + ((i) >= (need) ? 0x80000000u : 0))
+
+// takes blk with claim unless it has a lower one
+void check_claim(BLOCKTYPE blk, uint32_t claim)
+{
+	if (blk < DATASTART || blk >= (BLOCKTYPE) disk_blockcount || refs[blk])
+		return;
+	uint32_t cur = __atomic_load_n(&chk.owner[blk], __ATOMIC_RELAXED);
+	while ((cur == 0 || cur > claim) &&
+	       !__atomic_compare_exchange_n(&chk.owner[blk], &cur, claim, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// keeps blk taken with claim if it may, else records why not
+int check_keep(BLOCKTYPE blk, uint32_t claim, struct check_file *f)
+{
+	if (blk < DATASTART || blk >= (BLOCKTYPE) disk_blockcount) {
+		f->invalid = 1;
+		return 0;
+	}
+	if (refs[blk]) {
+		__atomic_fetch_add(&chk.holders[blk], 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&chk.seen[blk], 1, __ATOMIC_RELAXED);
+		f->unallocated += fat[blk] == 0;
+		return 1;
+	}
+	if (chk.owner[blk] != claim || chk.seen[blk]) {
+		f->crosslinked = 1;
+		return 0;
+	}
+	chk.seen[blk] = 1;
+	if (fat[blk] == 0)
+		f->unallocated++;
+	return 1;
+}
+
+// blocks needed to hold file
+int64_t check_need(int inum)
+{
+	return (dir->fcbs[inum].inode.size + disk_blocksize - 1) / disk_blocksize;
+}
+
+// first pass, a chain is followed at most once around the disk in case it loops
+void check_claimfile(int inum, int t)
+{
+	struct extlist *list = &extlists[inum];
+	struct inode *inode = &dir->fcbs[inum].inode;
+	int64_t need = check_need(inum), n = 0;
+
+	if (!dir->fcbs[inum].valid)
+		return;
+	if (superblock->flags & MYFS_EXTENTS) {
+		if (list->overflow)
+			check_claim(list->overflow, CLAIM(inum, 0, 1));
+		for (int i = 0; i < list->count; ++i) {
+			if (list->ext[i].start == 0) {
+				n += list->ext[i].len;
+				continue;
+			}
+			for (BLOCKTYPE j = 0; j < list->ext[i].len && list->ext[i].start + (uint64_t) j < (uint64_t) disk_blockcount; ++j)
+				check_claim(list->ext[i].start + j, CLAIM(inum, n++, need));
 		}
+		return;
+	}
 
-		// printf("written %d bytes, offset %d, block %d, size %d\n", siz, entry->offset, entry->curr, entry->inode->size);
-		// printf("written %s\n", buf + bytes_written);
+	BLOCKTYPE blk = inode->size ? inode->start : 0;
+	for (int k = 0; blk >= DATASTART && blk < (BLOCKTYPE) disk_blockcount && k < disk_blockcount; ++k, ++n) {
+		n += gaps[blk];
+		check_claim(blk, CLAIM(inum, n, need));
+		if (fat[blk] == 0 || fat[blk] == (BLOCKTYPE) -1)
+			break;
+		blk = fat[blk];
 	}
+}
 
-	putblock(entry->curr, blockbuf);
-	free(blockbuf);
-	return (bytes_written);
+// second pass, an empty file owns no blocks, even if start was left over
+// shared blocks do not stop a chain that loops, it is followed at most once around the disk
+void check_keepfile(int inum, int t)
+{
+	struct check_file *f = &chk.files[inum];
+	struct extlist *list = &extlists[inum];
+	struct inode *inode = &dir->fcbs[inum].inode;
+	int64_t need = check_need(inum);
+
+	memset(f, 0, sizeof(struct check_file));
+	if (!dir->fcbs[inum].valid)
+		return;
+	if (superblock->flags & MYFS_EXTENTS) {
+		if (list->overflow && !check_keep(list->overflow, CLAIM(inum, 0, 1), f))
+			f->overflow = 1;
+		int64_t n = 0;
+		for (int i = 0; i < list->count; ++i) {
+			if (list->ext[i].start == 0) {
+				n += list->ext[i].len;
+				continue;
+			}
+			for (BLOCKTYPE j = 0; j < list->ext[i].len; ++j, ++n) {
+				if (!check_keep(list->ext[i].start + j, CLAIM(inum, n, need), f))
+					return;
+				f->last = list->ext[i].start + j;
+				f->count++;
+				f->span = n + 1;
+				f->within += n < need;
+			}
+		}
+		return;
+	}
+
+	BLOCKTYPE blk = inode->size ? inode->start : 0;
+	while (blk && f->count < disk_blockcount) {
+		int64_t n = f->span + (blk < (BLOCKTYPE) disk_blockcount ? gaps[blk] : 0);
+		if (!check_keep(blk, CLAIM(inum, n, need), f))
+			break;
+		f->last = blk;
+		f->count++;
+		f->span = n + 1;
+		f->within += n < need;
+		if (fat[blk] == 0 || fat[blk] == (BLOCKTYPE) -1)
+			break;
+		blk = fat[blk];
+	}
 }
 
-int myfs_truncate(int fd, int size)
+// last pass, over the FAT entries of one FAT block
+void check_leaks(int i, int t)
 {
-	// compare size with current size
-	// then seek size in fat
-	// deallocate every block after current block in order on fat
-	// on current block, just change file size to size
+	int from = i * FATPERBLOCK, to = from + FATPERBLOCK < disk_blockcount ? from + FATPERBLOCK : disk_blockcount;
 
-	struct open_entry *entry = open_get(opentable, fd);
+	for (int blk = from; blk < to; ++blk) {
+		if (fat[blk] != 0 && (blk < DATASTART || !chk.seen[blk]))
+			chk.leaked[t]++;
+		else if (refs[blk] && (fat[blk] == 0 || chk.holders[blk] != (uint32_t) refs[blk] + 1))
+			chk.badrefs[t]++;
+	}
+}
 
-	if (entry == NULL || entry->inode->size <= size)
-		return -(!entry);
+struct check_work {
+	void (*fn)(int i, int t);
+	int n, t;
+};
 
-	// traverse fat until curr becomes outside size
-	BLOCKTYPE curr = entry->inode->start, temp;
-	for (int i = 0; i * BLOCKSIZE < size; ++i) // curr should never be -1 or 0
-		curr = fat_getnext(curr);
+void *check_run(void *arg)
+{
+	struct check_work *w = arg;
+	for (int i = w->t; i < w->n; i += chk.nthreads)
+		w->fn(i, w->t);
+	return NULL;
+}
 
-	// deallocate every block after and including curr
-	while (curr != (BLOCKTYPE) -1) { // should never be 0
-		temp = fat_getnext(curr);
-		if (fat_dealloc(curr))
-			return -1;
-		curr = temp;
+// runs fn(i, t) for every i in [0, n), thread t taking every nthreads-th i from t
+void check_parallel(void (*fn)(int i, int t), int n)
+{
+	pthread_t threads[chk.nthreads];
+	struct check_work work[chk.nthreads];
+	int started[chk.nthreads];
+
+	for (int t = 1; t < chk.nthreads; ++t) {
+		work[t] = (struct check_work) { fn, n, t };
+		started[t] = pthread_create(&threads[t], NULL, check_run, &work[t]) == 0;
+		if (!started[t])
+			check_run(&work[t]);
 	}
+	work[0] = (struct check_work) { fn, n, 0 };
+	check_run(&work[0]);
+	for (int t = 1; t < chk.nthreads; ++t)
+		if (started[t])
+			pthread_join(threads[t], NULL);
+}
 
-	entry->inode->size = size;
-	if (entry->offset > size)
-		entry->offset = size;
+// repairs file inum to hold the first keep blocks it kept, allocating them in FAT
+// blocks it kept past those are freed, blocks it claimed but did not keep are left to be found leaked
+// a chain is not cut at a shared block, the file keeps the blocks after it, which are shared as well
+void check_fix(int inum, int keep)
+{
+	struct check_file *f = &chk.files[inum];
+	struct extlist *list = &extlists[inum];
+	struct inode *inode = &dir->fcbs[inum].inode;
+	int extents = superblock->flags & MYFS_EXTENTS;
+	BLOCKTYPE blk = inode->start, next;
+	int64_t span = 0, n = 0; // logical blocks of extents up to the last block kept, and before blk
+
+	for (int i = 0, e = 0, j = 0; i < f->count; ++i) {
+		if (extents) {
+			while (j == (int) list->ext[e].len || list->ext[e].start == 0) {
+				n += list->ext[e].start ? 0 : list->ext[e].len;
+				++e, j = 0;
+			}
+			blk = list->ext[e].start + j++;
+			if (i < keep)
+				span = n + 1;
+			++n;
+		}
+		next = fat[blk];
+		if (!extents && i == keep - 1 && refs[blk] && keep < f->count)
+			break;
+		if (i >= keep && refs[blk]) {
+			chk.holders[blk]--;
+		} else if (i >= keep) {
+			fat_dealloc(blk);
+			chk.seen[blk] = 0;
+		} else if (fat[blk] == 0 || (!extents && i == keep - 1)) {
+			fat_setend(blk);
+			bitmap_set(freemap, blk);
+		}
+		blk = next;
+	}
 
-	return (0);
+	if (!extents) {
+		if (keep == 0)
+			inode->start = 0;
+		return;
+	}
+	ext_truncate(list, span);
+	if (f->overflow) {
+		list->overflow = 0; // belongs to another file, or is no block at all
+	} else if (list->overflow && fat[list->overflow] == 0) {
+		fat_setend(list->overflow);
+		bitmap_set(freemap, list->overflow);
+	}
+	if (list->count <= NDIRECTEXT && list->overflow) {
+		fat_dealloc(list->overflow);
+		chk.seen[list->overflow] = 0;
+		list->overflow = 0;
+	}
+	ext_dirty[inum] = 1;
+}
+
+int myfs_check(char *vdisk, int repair, int nthreads, struct myfs_check *res)
+{
+	memset(res, 0, sizeof(struct myfs_check));
+	log_reclaiming = 0; // deleted files are checked as they are
+	log_starting = repair; // nothing is committed unless repairing
+	int mounted = disk_fd == 0 && myfs_mountopt(vdisk, 0) == 0;
+	log_starting = 1;
+	if (!mounted) {
+		log_reclaiming = 1;
+		return -1;
+	}
+
+	// disk must not be mounted with MYFS_SHARED by any process, every such process holds a read lock on byte 1
+	int ok = disk_lock(1, F_WRLCK, 0) == 0;
+	if (ok) {
+		chk.nthreads = nthreads > 0 ? nthreads : 1;
+		chk.owner = calloc(disk_blockcount, sizeof(uint32_t));
+		chk.seen = calloc(disk_blockcount, 1);
+		chk.files = calloc(disk_maxfiles, sizeof(struct check_file));
+		chk.holders = calloc(disk_blockcount, sizeof(uint32_t));
+		chk.leaked = calloc(chk.nthreads, sizeof(int));
+		chk.badrefs = calloc(chk.nthreads, sizeof(int));
+		ok = chk.owner && chk.seen && chk.holders && chk.files && chk.leaked && chk.badrefs;
+	}
+
+	if (ok) {
+		check_parallel(check_claimfile, disk_maxfiles);
+		check_parallel(check_keepfile, disk_maxfiles);
+
+		if (repair)
+			op_begin();
+		for (int inum = 0; inum < disk_maxfiles; ++inum) {
+			struct check_file *f = &chk.files[inum];
+			struct inode *inode = &dir->fcbs[inum].inode;
+			int64_t need = check_need(inum);
+
+			if (!dir->fcbs[inum].valid)
+				continue;
+			res->files++;
+			res->blocks += f->count;
+			res->crosslinked += f->crosslinked;
+			res->invalid += f->invalid;
+			res->unallocated += f->unallocated;
+			// may hold a block it is being extended into, blocks missing within size are read as a hole
+			int mismatch = f->span > need + 1;
+			res->size_mismatch += mismatch;
+			if (!repair)
+				continue;
+
+			if (!inode->size)
+				inode->start = 0;
+			if (mismatch || f->crosslinked || f->invalid || f->unallocated || f->overflow)
+				check_fix(inum, mismatch ? f->within : f->count);
+		}
+
+		check_parallel(check_leaks, (disk_blockcount + FATPERBLOCK - 1) / FATPERBLOCK);
+		for (int t = 0; t < chk.nthreads; ++t) {
+			res->leaked += chk.leaked[t];
+			res->refcounts += chk.badrefs[t];
+		}
+
+		// counts of leaked blocks are dropped, others set to the files sharing the block
+		if (repair && (res->leaked || res->refcounts))
+			for (int blk = 0; blk < disk_blockcount; ++blk) {
+				int leaked = fat[blk] != 0 && (blk < DATASTART || !chk.seen[blk]);
+				uint16_t count = leaked || fat[blk] == 0 || chk.holders[blk] == 0 ? 0 : chk.holders[blk] - 1;
+				if (leaked)
+					fat_dealloc(blk);
+				if (blk < DATASTART || refs[blk] == count)
+					continue;
+				shared->saved_blocks += count - refs[blk];
+				refs[blk] = count;
+				fat_dirty[REFBLOCK(blk) - FATBLOCK(0)] = 1;
+			}
+		if (repair)
+			op_end();
+	}
+
+	free(chk.owner);
+	free(chk.seen);
+	free(chk.holders);
+	free(chk.files);
+	free(chk.leaked);
+	free(chk.badrefs);
+	memset(&chk, 0, sizeof(chk));
+
+	// repairs are committed and written in place like any change, else the disk is left as it was
+	if (ok && repair) {
+		log_reclaiming = 1;
+		return myfs_umount();
+	}
+	log_stop();
+	log_reclaiming = 1;
+	seg_free(1);
+	close(disk_fd);
+	disk_fd = 0;
+	return ok ? 0 : -1;
+}
+
+// Readahead
+
+// updates readahead window after a read of [start, end), and reads ahead once half of the window is used
+void file_readahead(struct open_entry *entry, int64_t start, int64_t end)
+{
+	struct blockmap *map = &bmaps[entry->inum];
+	int max = RAMAX;
+	if (!disk_map && max > cache->nframes / 4)
+		max = cache->nframes / 4;
+
+	// window collapses on random access
+	if (start != entry->ra_off) {
+		entry->ra_win = 0;
+		entry->ra_end = 0;
+	} else {
+		entry->ra_win = entry->ra_win ? entry->ra_win * 2 : RAMIN;
+		if (entry->ra_win > max)
+			entry->ra_win = max;
+	}
+	entry->ra_off = end;
+
+	int next = (end + disk_blocksize - 1) / disk_blocksize; // first block not read
+	if (entry->ra_win == 0 || entry->ra_end - next >= entry->ra_win / 2)
+		return;
+
+	int from = entry->ra_end > next ? entry->ra_end : next;
+	int to = next + entry->ra_win;
+	if (to > map->count)
+		to = map->count;
+	if (from >= to)
+		return;
+
+	int *blks = malloc((to - from) * sizeof(int)), n = 0;
+	for (int i = from; i < to; ++i)
+		if (map->blocks[i]) // holes are not read
+			blks[n++] = map->blocks[i];
+	prefetchblocks(blks, n); // only a hint, errors show up when blocks are read
+	free(blks);
+	entry->ra_end = to;
 }
 
+// Write buffers
+
+// writes buffered block of entry into the cache
+int wb_flush(struct open_entry *entry)
+{
+	if (entry->wblk == -1)
+		return 0;
+
+	int b = bmap_get(&bmaps[entry->inum], entry->wblk);
+	if (b == 0 || writeblock(b, entry->wbuf))
+		return -1;
+	entry->wblk = -1;
+	wb_pending[entry->inum]--;
+
+	// a size committed since the write may already cover the block, next commit writes it back
+	__atomic_store_n(&shared->log_pending, 1, __ATOMIC_RELAXED);
+	return 0;
+}
 
-int myfs_seek(int fd, int offset)
+int wb_flushfile(int inum, struct open_entry *except)
 {
-	int position = -1;
+	int res = 0;
 
-	// traverse fat
+	mutex_lock(open_lock);
+	for (int i = 0; i < MAXOPENFILES && !res; ++i) {
+		struct open_entry *entry = open_get(opentable, i);
+		if (entry && entry != except && entry->inum == inum && wb_flush(entry))
+			res = -1;
+	}
+	pthread_mutex_unlock(open_lock);
+	return res;
+}
+
+// Locking
+
+// returns open entry of fd with its lock held, or NULL if fd is not open
+struct open_entry *entry_lock(int fd)
+{
 	struct open_entry *entry = open_get(opentable, fd);
 	if (entry == NULL)
-		return position;
+		return NULL;
 
-	// compare offset with size
-	position = offset;
-	if (position > entry->inode->size)
-		position = entry->inode->size;
+	// entry may have been closed while waiting
+	pthread_mutex_lock(&entry->lock);
+	if (!entry->valid) {
+		pthread_mutex_unlock(&entry->lock);
+		return NULL;
+	}
+	return entry;
+}
 
-	// start from beginning of file
-	// entry->offset = 0;
-	entry->curr = entry->inode->start;
+// takes read lock of inum once no open entry of it has a buffered block, and its block map is up to date
+int inode_rdlock(int inum)
+{
+	for (;;) {
+		rwlock_rdlock(&inode_locks[inum]);
+		if (wb_pending[inum] == 0 && bmap_gens[inum] == file_gens[inum])
+			return 0;
+		rwlock_unlock(&inode_locks[inum]);
 
-	// skip blocks before last one
-	for (int i = 0; i < position / BLOCKSIZE; ++i) {
-		// entry->offset += BLOCKSIZE;
-		entry->curr = fat_getnext(entry->curr);
+		if (inode_wrlock(inum))
+			return -1;
+		int res = wb_flushfile(inum, NULL);
+		rwlock_unlock(&inode_locks[inum]);
+		if (res)
+			return -1;
 	}
-	entry->offset = position; // % BLOCKSIZE;
+}
 
-	return (position);
+// takes write lock of inum, once its block map is up to date
+int inode_wrlock(int inum)
+{
+	rwlock_wrlock(&inode_locks[inum]);
+	if (bmap_gens[inum] != file_gens[inum] && bmap_refresh(inum)) {
+		rwlock_unlock(&inode_locks[inum]);
+		return -1;
+	}
+	return 0;
 }
 
-int myfs_filesize (int fd)
+// Block access
+
+char *mapblock(int blk)
 {
-	int size = -1;
+	return disk_map + (size_t) blk * disk_blocksize;
+}
 
-	// retrieve open table entry
-	struct open_entry *entry = open_get(opentable, fd);
+// runs of at least this many blocks bypass the cache
+#define DIRECTBLOCKS 16
 
-	if (entry == NULL)
-		return size;
-	size = entry->inode->size;
+// reads blks[0..count-1] into consecutive blocks of buf
+int readblocks(int *blks, int count, void *buf)
+{
+	if (!disk_map && count >= DIRECTBLOCKS)
+		return cache_readthrough(cache, blks, count, buf);
+	if (!disk_map)
+		return cache_readblocks(cache, blks, count, buf);
 
-	return (size);
+	for (int i = 0; i < count; ++i) {
+		if (blks[i] < 0 || blks[i] >= disk_blockcount)
+			return -1;
+		memcpy((char *) buf + (size_t) i * disk_blocksize, mapblock(blks[i]), disk_blocksize);
+	}
+	return 0;
 }
 
+// returns contents of block blk, in place if disk is mapped, else read into buf
+char *loadblock(int blk, char *buf)
+{
+	if (blk < 0 || blk >= disk_blockcount)
+		return NULL;
+	if (disk_map)
+		return mapblock(blk);
+	return cache_read(cache, blk, buf) ? NULL : buf;
+}
 
-void myfs_print_dir ()
+// writes buf into block blk, buf may be the block's own address in the mapping
+int writeblock(int blk, void *buf)
 {
-	// linear scan through dir
-	for (int i = 0; i < dir->filenum; ++i)
-		printf("%s\n", dir->entries[i].filename);
+	if (!disk_map)
+		return cache_write(cache, blk, buf);
+
+	if (blk < 0 || blk >= disk_blockcount)
+		return -1;
+	if (buf != mapblock(blk))
+		memcpy(mapblock(blk), buf, disk_blocksize);
+	map_dirty[blk] = 1;
+	return 0;
 }
 
+// writes consecutive blocks of buf into blks[0..count-1]
+int writeblocks(int *blks, int count, void *buf)
+{
+	if (!disk_map && count >= DIRECTBLOCKS)
+		return cache_writethrough(cache, blks, count, buf);
 
-void myfs_print_blocks (char *  filename)
+	for (int i = 0; i < count; ++i)
+		if (writeblock(blks[i], (char *) buf + (size_t) i * disk_blocksize))
+			return -1;
+	return 0;
+}
+
+// starts loading blks[0..count-1] into the cache in the background, in one batch with MYFS_AIO,
+// or advises kernel to page them in if disk is mapped
+int prefetchblocks(int *blks, int count)
 {
-	// find filename on dir
-	// for each file, traverse fat from their start
-	int inum = dir_get(dir, filename);
+	if (!disk_map)
+		return cache_prefetch(cache, blks, count);
 
-	if (inum == -1) {
-		printf("Error: file %s does not exist.\n", filename);
-		return;
+	for (int i = 0, j; i < count; i = j) {
+		for (j = i + 1; j < count && blks[j] == blks[j - 1] + 1; ++j)
+			;
+		if (blks[i] <= 0 || blks[j - 1] >= disk_blockcount)
+			return -1;
+		madvise(mapblock(blks[i]), (size_t) (j - i) * disk_blocksize, MADV_WILLNEED);
 	}
+	return 0;
+}
 
-	BLOCKTYPE curr = dir->fcbs[inum].inode.start;
-	printf("%s:", filename);
-	while (curr != 0 && curr != (BLOCKTYPE) -1) {
-		printf(" %d", curr);
-		curr = fat_getnext(curr);
+// copies blocks from[0..count-1] into blocks to[0..count-1], through the cache or the mapping
+int copyblocks(int *from, int *to, int count)
+{
+	int n = count < COPYRUN ? count : COPYRUN, res = 0;
+	char *buf = malloc((size_t) (n ?: 1) * disk_blocksize);
+
+	for (int i = 0; i < count && !res; i += n) {
+		if (n > count - i)
+			n = count - i;
+		res = readblocks(from + i, n, buf) || writeblocks(to + i, n, buf) ? -1 : 0;
 	}
-	putchar('\n');
+	free(buf);
+	return res;
+}
+
+// synchronously flushes runs of dirty blocks in mapping
+int map_sync()
+{
+	int i = 0, j, res = 0;
+
+	while (i < disk_blockcount) {
+		if (!map_dirty[i]) {
+			++i;
+			continue;
+		}
+		for (j = i; j < disk_blockcount && map_dirty[j]; ++j)
+			map_dirty[j] = 0;
+		STAT_ADD(syncs, 1);
+		if (msync(mapblock(i), (size_t) (j - i) * disk_blocksize, MS_SYNC))
+			res = -1;
+		i = j;
+	}
+
+	return res;
 }
 
 // FAT functions
 
-// 2 bytes per FAT block, first 3 blocks for superblock and directory entry
-#define FATBLOCK(blk)  ((blk) / (BLOCKSIZE / 2) + 3)
-#define FATOFFSET(blk) ((blk) % (BLOCKSIZE / 2))
+// FAT is kept in memory in its entirety, FAT blocks are marked dirty on modification, until committed
+
+int fat_load()
+{
+	int ninit = superblock->fatinit < FATSIZE ? superblock->fatinit : FATSIZE;
+
+	// FAT is contiguous on disk, read it in as few I/Os as possible, only up to watermark
+	// rest of its copy in segment is still zeros
+	int *blks = malloc(FATSIZE * sizeof(int));
+	for (int i = 0; i < ninit; ++i)
+		blks[i] = FATBLOCK(0) + i;
+	int res = ninit ? readblocks(blks, ninit, fat) : 0;
+	free(blks);
+	return res;
+}
+
+// marks metadata region and every allocated block in free block bitmap, and counts blocks saved by clones
+int fat_buildmap()
+{
+	bitmap_attach(freemap, disk_blockcount, freemap->words);
+
+	shared->saved_blocks = 0;
+	for (int i = 0; i < disk_blockcount; ++i) {
+		if (i < DATASTART || fat[i] != 0)
+			bitmap_set(freemap, i);
+		shared->saved_blocks += refs[i];
+	}
+
+	return 0;
+}
 
-// size of FAT in blocks
-#define FATSIZE (BLOCKCOUNT * 2 / BLOCKSIZE)
+// writes FAT blocks logged since last checkpoint, as of last commit
+int fat_sync()
+{
+	// every block between watermark and last logged block is written, so that watermark can move past them
+	int last = -1;
+	for (int i = 0; i < FATSIZE; ++i)
+		if (shared->fat_logged[i])
+			last = i;
+
+	for (int i = 0; i <= last; ++i) {
+		if (!shared->fat_logged[i] && i < (int) superblock->fatinit)
+			continue;
+		if (writeblock(FATBLOCK(0) + i, ((char *) shared->fat_shadow) + (size_t) i * disk_blocksize))
+			return -1;
+		shared->fat_logged[i] = 0;
+	}
+	if (last >= (int) superblock->fatinit)
+		superblock->fatinit = last + 1;
 
-// may cache the following with buffers, written after each set
+	return 0;
+}
 
 BLOCKTYPE fat_getnext(BLOCKTYPE blk)
 {
-	// read block in FAT
-	BLOCKTYPE *buf = malloc(BLOCKSIZE);
-	if (getblock(FATBLOCK(blk), buf)) {
-		free(buf);
+	STAT_ADD(fat_lookups, 1);
+	if (blk >= disk_blockcount)
 		return 0; // used only for unallocated blocks anyway
+	return fat[blk];
+}
+
+BLOCKTYPE fat_alloc(BLOCKTYPE hint)
+{
+	int from, res;
+
+	if (hint) {
+		// continue the run of the file if possible
+		from = hint + 1;
+		if (from < disk_blockcount && !bitmap_test(freemap, from)) {
+			res = from;
+			goto found;
+		}
+	} else {
+		// leaps to 5x+1 for each new file, where x is the previous starting point in data region
+		// taken mod q, the largest power of 2 not above the number of data blocks
+		// x -> px+1 mod q is bijective for (p,q) = 1 and (p-1) | q and provides good separation
+		// In fact, x -> 5x+1 mod q will tour all integers mod q much like x -> x+1 mod q will,
+		//  by noting that the nth iteration of the function takes x to 5^n x + (5^n-1)/(5-1) mod q
+		//  and then showing by induction that 2^k divides (5^n-1)/(5-1) (hence (5^n-1)/(5-1)*(4x+1)) iff 2^k divides n
+		uint32_t q = 1;
+		while (2 * q <= (uint32_t) (disk_blockcount - DATASTART))
+			q *= 2;
+		shared->newfile_hint = DATASTART + (5 * (uint64_t) (shared->newfile_hint - DATASTART) + 1) % q;
+		from = shared->newfile_hint;
 	}
-	BLOCKTYPE res = buf[FATOFFSET(blk)];
-	// printf("%d: disk[%d][%d] = %d\n", blk, FATBLOCK(blk), FATOFFSET(blk), res);
-	free(buf);
+
+	// start a new run where there is room to grow, else take any free block
+	res = bitmap_findrun(freemap, ALLOCRUN, from, DATASTART, disk_blockcount);
+	if (res == -1)
+		res = bitmap_find(freemap, from, DATASTART, disk_blockcount);
+	if (res == -1) // no free space
+		return 0;
+
+found:
+	STAT_ADD(allocs, 1);
+	bitmap_set(freemap, res);
+	fat[res] = -1; // allocated but not yet used
+	fat_dirty[FATBLOCK(res) - FATBLOCK(0)] = 1;
 	return res;
 }
 
 BLOCKTYPE fat_setnext(BLOCKTYPE blk)
 {
-	BLOCKTYPE *buf = malloc(BLOCKSIZE);
-
-	// search for free space in current block, else jump to another block of FAT
-	BLOCKTYPE newblk = blk ?: BLOCKCOUNT/3, // perhaps pick a more random default quantity
-	          res = 0;
-	while (!res) {
-		// searches linearly for next block of same file, else leaps to 5x+1 where x is the current block in data region
-		// 5 is coprime with 3*BLOCKCOUNT/4 = 24K, the number of blocks dedicated to file data
-		// x -> px+1 mod q is bijective for (p,q) = 1 and (p-1) | q and provides good separation
-		// In fact, one can probably show x -> 5x+1 mod 24K will tour all integers mod 24K much like x -> x+1 mod 24K will,
-		//  by noting that the nth iteration of the function takes x to 5^n x + (5^n-1)/(5-1) mod 24K
-		//  and then showing by induction that 2^k divides (5^n-1)/(5-1) (hence (5^n-1)/(5-1)*(4x+1)) iff 2^k divides n
-		newblk = BLOCKCOUNT/4 + ((1+4*!blk) * (newblk - BLOCKCOUNT/4) + 1) % (3*BLOCKCOUNT/4);
-		if (newblk == blk) // went full circle, no free space
-			break;
+	BLOCKTYPE res = fat_alloc(blk);
 
-		// first check if load unnecessary
-		if (getblock(FATBLOCK(newblk), buf))
-			break;
-		if (buf[FATOFFSET(newblk)] == 0) {
-			res = newblk;
-			buf[FATOFFSET(newblk)] = -1; // allocated but not yet used
-			if (putblock(FATBLOCK(newblk), buf))
-				res = -1; // signifies error
-			else if (blk) {
-				if (getblock(FATBLOCK(blk), buf)) {
-					res = -1;
-				} else {
-					buf[FATOFFSET(blk)] = newblk;
-					if (putblock(FATBLOCK(blk), buf))
-						res = -1; // 6 indents, sorry Linus
-				}
-			}
-		}
+	if (res && blk) {
+		fat[blk] = res;
+		fat_dirty[FATBLOCK(blk) - FATBLOCK(0)] = 1;
 	}
 
-	free(buf);
 	return res;
 }
 
-int fat_dealloc(BLOCKTYPE blk)
+int fat_setend(BLOCKTYPE blk)
 {
-	// read block in FAT
-	BLOCKTYPE *buf = malloc(BLOCKSIZE);
-	if (getblock(FATBLOCK(blk), buf)) {
-		free(buf);
+	if (blk >= disk_blockcount)
+		return -1;
+
+	fat[blk] = -1;
+	fat_dirty[FATBLOCK(blk) - FATBLOCK(0)] = 1;
+	return 0;
+}
+
+int fat_link(BLOCKTYPE blk, BLOCKTYPE next)
+{
+	if (blk >= disk_blockcount)
+		return -1;
+
+	fat[blk] = next;
+	fat_dirty[FATBLOCK(blk) - FATBLOCK(0)] = 1;
+	return 0;
+}
+
+int fat_share(BLOCKTYPE blk)
+{
+	if (blk < DATASTART || blk >= disk_blockcount || refs[blk] == MAXREFS)
 		return -1;
-	}
 
-	buf[FATOFFSET(blk)] = 0;
+	refs[blk]++;
+	fat_dirty[REFBLOCK(blk) - FATBLOCK(0)] = 1;
+	shared->saved_blocks++;
+	return 0;
+}
 
-	if (putblock(FATBLOCK(blk), buf)) {
-		free(buf);
+int fat_release(BLOCKTYPE blk)
+{
+	if (blk >= disk_blockcount)
 		return -1;
+	if (refs[blk] == 0)
+		return fat_dealloc(blk);
+
+	// FAT entry of a shared block is left as it is, the chain goes on for the files still holding it
+	refs[blk]--;
+	fat_dirty[REFBLOCK(blk) - FATBLOCK(0)] = 1;
+	shared->saved_blocks--;
+	return 0;
+}
+
+int fat_releaseblocks(BLOCKTYPE *blks, int n)
+{
+	for (int i = 0, j; i < n; i = j) {
+		BLOCKTYPE blk = blks[i];
+
+		j = i + 1;
+		if (blk == 0)
+			continue;
+		if (blk < DATASTART || blk >= disk_blockcount || refs[blk]) {
+			if (fat_release(blk))
+				return -1;
+			continue;
+		}
+
+		// run of consecutive unshared blocks with entries in the same FAT block, cleared at once, see fat_dealloc
+		while (j < n && blks[j] == blk + (j - i) && blks[j] < disk_blockcount && FATOFFSET(blks[j]) != 0 && refs[blks[j]] == 0)
+			++j;
+		memset(&fat[blk], 0, (j - i) * sizeof(BLOCKTYPE));
+		memset(&gaps[blk], 0, (j - i) * sizeof(uint32_t));
+		fat_dirty[FATBLOCK(blk) - FATBLOCK(0)] = 1;
+		fat_dirty[GAPBLOCK(blk) - FATBLOCK(0)] = 1;
+		fat_freed[FATBLOCK(blk) - FATBLOCK(0)] = 1;
 	}
+	return 0;
+}
 
-	free(buf);
+int fat_setgap(BLOCKTYPE blk, uint32_t gap)
+{
+	if (blk >= disk_blockcount)
+		return -1;
+
+	if (gaps[blk] != gap) {
+		gaps[blk] = gap;
+		fat_dirty[GAPBLOCK(blk) - FATBLOCK(0)] = 1;
+	}
+	return 0;
+}
+
+int fat_dealloc(BLOCKTYPE blk)
+{
+	if (blk >= disk_blockcount)
+		return -1;
+
+	fat[blk] = 0;
+	fat_dirty[FATBLOCK(blk) - FATBLOCK(0)] = 1;
+	fat_freed[FATBLOCK(blk) - FATBLOCK(0)] = 1;
+	fat_setgap(blk, 0);
 	return 0;
 }
+
+// a freed block stays set in freemap until the FAT freeing it is committed, so that it is not written over while
+// metadata replayed after a crash, or written in place at checkpoint, still has it in a file
+// blocks with a 0 entry set in freemap are those, other allocated blocks have nonzero entries
+void fat_releasefreed()
+{
+	for (int i = 0; i <= FATBLOCK(disk_blockcount - 1) - FATBLOCK(0); ++i) {
+		if (!fat_freed[i])
+			continue;
+
+		// blocks freed after the batch was taken are left to the next commit
+		int left = 0, end = (i + 1) * FATPERBLOCK < (size_t) disk_blockcount ? (int) ((i + 1) * FATPERBLOCK) : disk_blockcount;
+		for (int blk = i * FATPERBLOCK > (size_t) DATASTART ? (int) (i * FATPERBLOCK) : (int) DATASTART; blk < end; ++blk) {
+			if (fat[blk] != 0 || !bitmap_test(freemap, blk))
+				continue;
+			if (shared->fat_shadow[blk] == 0)
+				bitmap_clear(freemap, blk);
+			else
+				left = 1;
+		}
+		fat_freed[i] = left;
+	}
+}
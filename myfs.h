@@ -1,21 +1,42 @@
 #ifndef MYFS_H
 #define MYFS_H
 
+#include <stdint.h>
+
+// geometry used by myfs_makefs, other geometries may be given to myfs_makefsgeom
 #define BLOCKSIZE          4096     // bytes
 #define MAXFILECOUNT       128      // files
 #define DISKSIZE         (1<<27)  // 128 MB
-#define MAXFILENAMESIZE    32  // characters - max that FS can support
 #define BLOCKCOUNT      (DISKSIZE / BLOCKSIZE)
+
+#define MINBLOCKSIZE       4096     // bytes; block size must be a power of 2 in this range
+#define MAXBLOCKSIZE       65536
+#define MAXDIRSIZE       (1<<24)  // bytes; directory region of a disk is at most this big, which bounds its max files
+#define MAXFILENAMESIZE    32  // characters - max that FS can support
 #define MAXOPENFILES       64      // files
-#define MAXREADWRITE      1024     // bytes; max read/write amount
+#define MAXREADWRITE      1024     // bytes; read/write amount used by sample programs, larger requests are allowed
+#define CACHEFRAMES        256      // default number of blocks in block cache
+
+// format options
+#define MYFS_EXTENTS       1        // files stored as lists of extents instead of FAT chains
 
 // The following will be use to create and format a disk
 int myfs_diskcreate(char *diskname);
 int myfs_makefs (char *diskname);
+int myfs_makefsopt (char *diskname, int opts);
+int myfs_makefsgeom (char *diskname, int64_t disksize, int blocksize, int maxfiles, int opts);
+
+// mount options
+#define MYFS_MMAP          1        // map whole disk into memory instead of going through block cache
+#define MYFS_AIO           2        // submit batches of cache misses and write-backs asynchronously
+#define MYFS_SHARED        4        // share mounted disk with other processes mounting it with MYFS_SHARED
+#define MYFS_LAZYFREE      8        // myfs_delete leaves freeing blocks of file to a background thread
 
 // The following will be used by a program to work with files
 int myfs_mount (char *vdisk);
+int myfs_mountopt (char *vdisk, int opts);
 int myfs_umount();
+int myfs_cachesize(int frames); // must be called before mount
 
 int myfs_create(char *filename);
 int myfs_open(char *filename);
@@ -23,9 +44,45 @@ int myfs_close(int fd);
 int myfs_delete(char *filename);
 int myfs_read(int fd, void *buf, int n);
 int myfs_write(int fd, void *buf, int n);
-int myfs_truncate(int fd, int size);
-int myfs_seek(int fd, int offset);
-int myfs_filesize(int fd);
+int myfs_truncate(int fd, int64_t size);
+int64_t myfs_seek(int fd, int64_t offset);
+int64_t myfs_filesize(int fd);
+int myfs_fsync(int fd); // data and metadata of file reach disk
+int myfs_sync(); // data and metadata of every file reach disk
+int myfs_copy(char *src, char *dst); // dst is created or truncated
+int myfs_clone(char *src, char *dst); // dst is created sharing blocks of src, copied once written
+int64_t myfs_export(int fd, int host_fd); // from offset of fd to its end, returns bytes copied
+int64_t myfs_import(int fd, int host_fd); // from offset of host_fd to its end
+
+// counters of mounted disk since mount or last myfs_stats_reset, of every process mounting it with MYFS_SHARED
+struct myfs_stats {
+	uint64_t reads, writes;            // I/O requests made to disk file
+	uint64_t read_bytes, write_bytes;
+	uint64_t syncs;                    // fdatasync and msync calls
+	uint64_t fat_lookups;              // FAT entries followed
+	uint64_t allocs;                   // blocks allocated
+	uint64_t alloc_probes;             // words of free block bitmap searched, none if the block after the end of a file is free
+	uint64_t cache_hits, cache_misses, cache_writebacks;
+	uint64_t dir_lookups;              // searches of directory by file name
+	uint64_t cow_copies;               // blocks shared with clones copied before being written
+	int open_files, open_max;          // entries of open file table of process in use, now and at most
+	int64_t saved_blocks;              // blocks clones would take as copies, now: every block once for each file holding it past the first
+};
+int myfs_stats(struct myfs_stats *stats);
+int myfs_stats_reset();
+
+// problems found by myfs_check in an unmounted disk, repaired if asked to
+struct myfs_check {
+	int files;                         // files checked
+	int64_t blocks;                    // blocks held by them
+	int leaked;                        // blocks allocated in FAT but held by no file
+	int unallocated;                   // blocks held by files but free in FAT
+	int crosslinked;                   // files reaching blocks of a file of lower number, or a block of their own again
+	int invalid;                       // files reaching blocks outside the data region
+	int size_mismatch;                 // files holding blocks past their size
+	int refcounts;                     // blocks whose reference count does not match the files holding them
+};
+int myfs_check(char *vdisk, int repair, int nthreads, struct myfs_check *res);
 void myfs_print_dir();
 void myfs_print_blocks(char *filename);
 
@@ -21,9 +21,16 @@ struct opentable {
 };
 */
 
-void open_init(struct opentable *open)
+size_t open_size(int maxfiles)
 {
-	memset(open, 0, sizeof(struct opentable));
+	return sizeof(struct opentable) + maxfiles * sizeof(int);
+}
+
+void open_init(struct opentable *open, int maxfiles)
+{
+	memset(open, 0, open_size(maxfiles));
+	for (int i = 0; i < MAXOPENFILES; ++i)
+		pthread_mutex_init(&open->entries[i].lock, NULL);
 }
 
 int open_add(struct opentable *open, char *filename, BLOCKTYPE inum, struct dir *dir)
@@ -39,6 +46,11 @@ int open_add(struct opentable *open, char *filename, BLOCKTYPE inum, struct dir
 	memcpy(entry->filename, filename, MAXFILENAMESIZE); // should it be strcpy?
 	entry->inum = inum;
 	entry->offset = 0;
+	entry->wbuf = NULL;
+	entry->wblk = -1;
+	entry->ra_off = 0;
+	entry->ra_win = 0;
+	entry->ra_end = 0;
 
 	// printf("added inode %d to open table with fd %d\n", inum, open->minfree);
 
@@ -65,7 +77,7 @@ int open_add(struct opentable *open, char *filename, BLOCKTYPE inum, struct dir
 
 int open_close(struct opentable *open, int fd)
 {
-	if (!open->entries[fd].valid)
+	if (fd < 0 || fd >= MAXOPENFILES || !open->entries[fd].valid)
 		return -1;
 
 	open->entries[fd].valid = 0;
@@ -86,11 +98,14 @@ int open_isopen(struct opentable *open, char *filename, struct dir *dir)
 	return 0;
 	*/
 
-	return open->counts[dir_get(dir, filename)];
+	int inum = dir_get(dir, filename);
+	return inum == -1 ? 0 : open->counts[inum];
 }
 
 struct open_entry *open_get(struct opentable *open, int fd)
 {
+	if (fd < 0 || fd >= MAXOPENFILES)
+		return NULL;
 	struct open_entry *entry = &open->entries[fd];
 	return entry->valid ? entry : NULL;
 }
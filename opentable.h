@@ -1,6 +1,8 @@
 #ifndef __OPEN_H
 #define __OPEN_H
 
+#include <pthread.h>
+
 #include "myfs.h"
 #include "dir.h"
 
@@ -12,15 +14,24 @@ struct opentable {
 		char filename[MAXFILENAMESIZE]; // search through dir
 		BLOCKTYPE inum;  // index of fcb
 		struct inode *inode;
-		int offset;
+		int64_t offset;
 		BLOCKTYPE curr;  // current block
+		char *wbuf;      // partially written block, kept until cursor leaves it
+		int wblk;        // logical block held in wbuf, -1 if none
+		int64_t ra_off;  // offset where last read ended, reads starting there are sequential
+		int ra_win;      // readahead window in blocks, 0 after random access
+		int ra_end;      // logical block after the last one read ahead
+		pthread_mutex_t lock; // serializes calls on the same descriptor
 	} entries[MAXOPENFILES];
-	int counts[MAXFILECOUNT]; // no of open instances of each file // can be kept in shared memory, with rest in process address space
 	int filenum; // no of open files
 	int minfree; // smallest free index in table, -1 if full, may be updated after opening or closing files
+	int counts[]; // no of open instances of each file, one for each fcb // can be kept in shared memory, with rest in process address space
 };
 
-void open_init(struct opentable *);
+// size of open file table for maxfiles files
+size_t open_size(int maxfiles);
+
+void open_init(struct opentable *, int maxfiles);
 
 int open_add(struct opentable *, char *filename, BLOCKTYPE inum, struct dir *);
 